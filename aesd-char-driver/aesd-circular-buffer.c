@@ -10,8 +10,16 @@
 
 #ifdef __KERNEL__
 #include <linux/string.h>
+#include <linux/errno.h>
+#include <linux/slab.h>
+#define AESD_CB_ALLOC(n) kvcalloc(n, sizeof(struct aesd_buffer_entry), GFP_KERNEL)
+#define AESD_CB_FREE(p) kvfree(p)
 #else
 #include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#define AESD_CB_ALLOC(n) calloc(n, sizeof(struct aesd_buffer_entry))
+#define AESD_CB_FREE(p) free(p)
 #endif
 
 #include "aesd-circular-buffer.h"
@@ -32,21 +40,71 @@
 struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
             size_t char_offset, size_t *entry_offset_byte_rtn )
 {
-    int i = buffer->out_offs;
-    do {
+    uint32_t count = aesd_circular_buffer_count(buffer);
+    uint32_t lo = 0, hi, mid;
+    size_t base;
+    struct aesd_buffer_entry *entry;
 
-        // DEBUG_LOG("i: %d", i);
-        // DEBUG_LOG("offset: %lu", char_offset);
+    if (count == 0 || char_offset >= aesd_circular_buffer_total_size(buffer)) return NULL;
 
-        if (char_offset < buffer->entry[i].size){
-            *entry_offset_byte_rtn = char_offset;
-            return &buffer->entry[i];
-        }else{
-            char_offset -= buffer->entry[i].size;
-        }
-        i = (i + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-    } while (i != buffer->in_offs);
-    return NULL;
+    // entry offsets increase from the oldest entry, so find the last one starting at or before char_offset.
+    base = buffer->entry[buffer->out_offs].offset;
+    hi = count - 1;
+    while (lo < hi) {
+        mid = lo + (hi - lo + 1) / 2;
+        if (buffer->entry[aesd_circular_buffer_slot(buffer, mid)].offset - base <= char_offset) lo = mid;
+        else hi = mid - 1;
+    }
+
+    entry = &buffer->entry[aesd_circular_buffer_slot(buffer, lo)];
+    *entry_offset_byte_rtn = char_offset - (entry->offset - base);
+    return entry;
+}
+
+/**
+ * @return the number of bytes held by all entries of @param buffer, in O(1).
+ * Any necessary locking must be performed by caller.
+ */
+size_t aesd_circular_buffer_total_size(const struct aesd_circular_buffer *buffer)
+{
+    if (aesd_circular_buffer_count(buffer) == 0) return 0;
+    return buffer->bytes_added - buffer->entry[buffer->out_offs].offset;
+}
+
+/**
+ * @param n the zero referenced index of the entry to return, counted from the oldest entry.
+ * @param char_offset_rtn is set to the position of the first byte of the returned entry if all
+ *      buffer strings were concatenated end to end. May be NULL.
+ * @return the @param n th oldest entry of @param buffer, or NULL if fewer entries are stored.
+ * Any necessary locking must be performed by caller.
+ */
+struct aesd_buffer_entry *aesd_circular_buffer_get_entry(struct aesd_circular_buffer *buffer,
+            uint32_t n, size_t *char_offset_rtn)
+{
+    struct aesd_buffer_entry *entry;
+
+    if (n >= aesd_circular_buffer_count(buffer)) return NULL;
+    entry = &buffer->entry[aesd_circular_buffer_slot(buffer, n)];
+    if (char_offset_rtn) *char_offset_rtn = entry->offset - buffer->entry[buffer->out_offs].offset;
+    return entry;
+}
+
+/**
+ * @param seq the sequence number to look for.
+ * @param char_offset_rtn is set as for aesd_circular_buffer_get_entry(). May be NULL.
+ * @return the oldest entry of @param buffer whose seq is at least @param seq, or NULL if
+ * there is none. Its seq is greater than @param seq if that entry has been evicted.
+ * Any necessary locking must be performed by caller.
+ */
+struct aesd_buffer_entry *aesd_circular_buffer_find_entry_for_seq(struct aesd_circular_buffer *buffer,
+            uint64_t seq, size_t *char_offset_rtn)
+{
+    uint32_t count = aesd_circular_buffer_count(buffer);
+    uint64_t first = buffer->entries_added - count;
+
+    // sequence numbers of the stored entries are consecutive, no search needed.
+    if (seq >= buffer->entries_added) return NULL;
+    return aesd_circular_buffer_get_entry(buffer, seq > first ? seq - first : 0, char_offset_rtn);
 }
 
 /**
@@ -59,11 +117,14 @@ struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct
 void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry)
 {
     // if buffer is full, we move the out_offs.
-    if (buffer->full) buffer->out_offs = (buffer->out_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    if (buffer->full) buffer->out_offs = aesd_circular_buffer_next(buffer, buffer->out_offs);
 
     buffer->entry[buffer->in_offs] = *add_entry;
     buffer->entry[buffer->in_offs].size = add_entry->size;
-    buffer->in_offs = (buffer->in_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    buffer->entry[buffer->in_offs].offset = buffer->bytes_added;
+    buffer->bytes_added += add_entry->size;
+    buffer->entry[buffer->in_offs].seq = buffer->entries_added++;
+    buffer->in_offs = aesd_circular_buffer_next(buffer, buffer->in_offs);
 
     // If out_offs and in_offs become equal, this indicates that the buffer is now full.
     // This is the signal to move out_offs the next time an entry is added.
@@ -71,12 +132,134 @@ void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const s
 
 }
 
+/**
+* Removes the oldest entry of @param buffer, e.g. to keep the bytes it holds under a limit.
+* @param removed_rtn receives the removed entry so the caller can release its memory. May be NULL.
+* @return false if @param buffer was empty.
+* Any necessary locking must be handled by the caller.
+*/
+bool aesd_circular_buffer_remove_oldest(struct aesd_circular_buffer *buffer, struct aesd_buffer_entry *removed_rtn)
+{
+    if (aesd_circular_buffer_count(buffer) == 0) return false;
+    if (removed_rtn) *removed_rtn = buffer->entry[buffer->out_offs];
+    buffer->out_offs = aesd_circular_buffer_next(buffer, buffer->out_offs);
+    buffer->full = false;
+    return true;
+}
+
 /**
 * Initializes the circular buffer described by @param buffer to an empty struct
+* holding up to AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED entries, without allocating.
 */
 void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer)
 {
     memset(buffer,0,sizeof(struct aesd_circular_buffer));
+    buffer->entry = buffer->entry_inline;
+    buffer->capacity = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+}
+
+/**
+* Initializes @param buffer to an empty struct holding up to @param capacity entries.
+* Storage for capacities other than the default is allocated and must be released
+* with aesd_circular_buffer_free().
+* @return 0 on success, -EINVAL for a capacity outside 1..AESDCHAR_MAX_CAPACITY or
+* -ENOMEM if the entry array could not be allocated.
+*/
+int aesd_circular_buffer_init_capacity(struct aesd_circular_buffer *buffer, uint32_t capacity)
+{
+    aesd_circular_buffer_init(buffer);
+    return aesd_circular_buffer_resize(buffer, capacity, NULL);
+}
+
+/**
+* @return the number of entries currently stored in @param buffer
+*/
+uint32_t aesd_circular_buffer_count(const struct aesd_circular_buffer *buffer)
+{
+    if (buffer->full) return buffer->capacity;
+    if (buffer->in_offs >= buffer->out_offs) return buffer->in_offs - buffer->out_offs;
+    return buffer->capacity - buffer->out_offs + buffer->in_offs;
+}
+
+/**
+* Moves the entries of @param buffer into @param storage, an array of @param capacity entries,
+* keeping the most recent ones. A NULL @param storage selects the inline array, which is only
+* valid for a capacity of AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED.
+* When shrinking below the current count, the oldest entries are passed to @param drop
+* (which may be NULL) so the caller can release their memory.
+* Does not allocate, so it may run where sleeping is not allowed.
+* Any necessary locking must be handled by the caller.
+* @return the entry array no longer referenced by @param buffer (the previous one, or @param storage
+* if the capacity did not change), or NULL if that is the inline array. The caller frees it.
+*/
+struct aesd_buffer_entry *aesd_circular_buffer_set_storage(struct aesd_circular_buffer *buffer,
+            uint32_t capacity, struct aesd_buffer_entry *storage,
+            void (*drop)(struct aesd_buffer_entry *entry))
+{
+    struct aesd_buffer_entry *old = buffer->entry;
+    uint32_t count = aesd_circular_buffer_count(buffer);
+    uint32_t i, n;
+
+    if (!storage) storage = buffer->entry_inline;
+    if (capacity == buffer->capacity) {
+        old = storage;
+    } else {
+        // drop the oldest entries which no longer fit, then repack the rest from index 0.
+        i = buffer->out_offs;
+        for (; count > capacity; count--) {
+            if (drop) drop(&buffer->entry[i]);
+            i = aesd_circular_buffer_next(buffer, i);
+        }
+        for (n = 0; n < count; n++) {
+            storage[n] = buffer->entry[i];
+            i = aesd_circular_buffer_next(buffer, i);
+        }
+        if (storage == buffer->entry_inline) {
+            memset(&storage[count], 0, (capacity - count) * sizeof(struct aesd_buffer_entry));
+        }
+
+        buffer->entry = storage;
+        buffer->capacity = capacity;
+        buffer->out_offs = 0;
+        buffer->in_offs = (count == capacity) ? 0 : count;
+        buffer->full = (count == capacity);
+    }
+    return (old == buffer->entry_inline) ? NULL : old;
+}
+
+/**
+* Changes the capacity of @param buffer to @param capacity, keeping the most recent entries.
+* When shrinking below the current count, the oldest entries are passed to @param drop
+* (which may be NULL) so the caller can release their memory.
+* Any necessary locking must be handled by the caller.
+* @return 0 on success, -EINVAL for a capacity outside 1..AESDCHAR_MAX_CAPACITY or
+* -ENOMEM if the new entry array could not be allocated, in which case @param buffer is unchanged.
+*/
+int aesd_circular_buffer_resize(struct aesd_circular_buffer *buffer, uint32_t capacity,
+            void (*drop)(struct aesd_buffer_entry *entry))
+{
+    struct aesd_buffer_entry *storage = NULL;
+
+    if (capacity == 0 || capacity > AESDCHAR_MAX_CAPACITY) return -EINVAL;
+    if (capacity == buffer->capacity) return 0;
+
+    if (capacity != AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) {
+        storage = AESD_CB_ALLOC(capacity);
+        if (!storage) return -ENOMEM;
+    }
+    storage = aesd_circular_buffer_set_storage(buffer, capacity, storage, drop);
+    if (storage) AESD_CB_FREE(storage);
+    return 0;
+}
+
+/**
+* Releases the entry array of @param buffer, leaving it empty with the default capacity.
+* Memory referenced by the entries themselves must be released by the caller first.
+*/
+void aesd_circular_buffer_free(struct aesd_circular_buffer *buffer)
+{
+    if (buffer->entry != buffer->entry_inline) AESD_CB_FREE(buffer->entry);
+    aesd_circular_buffer_init(buffer);
 }
 
 // static void write_circular_buffer_packet(struct aesd_circular_buffer *buffer,
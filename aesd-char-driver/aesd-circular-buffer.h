@@ -16,7 +16,15 @@
 #include <stdbool.h>
 #endif
 
+/**
+ * Default capacity, stored inline in struct aesd_circular_buffer
+ */
 #define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10
+/**
+ * Upper bound for a capacity selected with aesd_circular_buffer_init_capacity()
+ * or aesd_circular_buffer_resize()
+ */
+#define AESDCHAR_MAX_CAPACITY 65536
 
 struct aesd_buffer_entry
 {
@@ -28,27 +36,58 @@ struct aesd_buffer_entry
      * Number of bytes stored in buffptr
      */
     size_t size;
+    /**
+     * Value of bytes_added in the owning buffer when this entry was added, i.e. the
+     * position of its first byte in the stream of all bytes ever added.
+     * Set by aesd_circular_buffer_add_entry().
+     */
+    size_t offset;
+    /**
+     * Value of entries_added in the owning buffer when this entry was added, so
+     * entries are numbered 0, 1, 2... in the order they were added, across wraps.
+     * Set by aesd_circular_buffer_add_entry().
+     */
+    uint64_t seq;
 };
 
 struct aesd_circular_buffer
 {
     /**
-     * An array of pointers to memory allocated for the most recent write operations
+     * An array of pointers to memory allocated for the most recent write operations.
+     * Points at entry_inline for the default capacity, or at a dynamically
+     * allocated array of capacity entries.
      */
-    struct aesd_buffer_entry  entry[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    struct aesd_buffer_entry *entry;
+    /**
+     * Storage used when capacity is AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
+     */
+    struct aesd_buffer_entry entry_inline[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    /**
+     * Number of entries in the entry array
+     */
+    uint32_t capacity;
     /**
      * The current location in the entry structure where the next write should
      * be stored.
      */
-    uint8_t in_offs;
+    uint32_t in_offs;
     /**
      * The first location in the entry structure to read from
      */
-    uint8_t out_offs;
+    uint32_t out_offs;
     /**
      * set to true when the buffer entry structure is full
      */
     bool full;
+    /**
+     * Running total of bytes ever added. Together with the offset of the oldest
+     * entry this gives the total size in O(1) and lets lookups binary search.
+     */
+    size_t bytes_added;
+    /**
+     * Number of entries ever added, the sequence number of the next entry
+     */
+    uint64_t entries_added;
 };
 
 extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
@@ -56,16 +95,58 @@ extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos
 
 extern void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry);
 
+extern bool aesd_circular_buffer_remove_oldest(struct aesd_circular_buffer *buffer,
+            struct aesd_buffer_entry *removed_rtn);
+
 extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
 
+extern int aesd_circular_buffer_init_capacity(struct aesd_circular_buffer *buffer, uint32_t capacity);
+
+extern int aesd_circular_buffer_resize(struct aesd_circular_buffer *buffer, uint32_t capacity,
+            void (*drop)(struct aesd_buffer_entry *entry));
+
+extern struct aesd_buffer_entry *aesd_circular_buffer_set_storage(struct aesd_circular_buffer *buffer,
+            uint32_t capacity, struct aesd_buffer_entry *storage,
+            void (*drop)(struct aesd_buffer_entry *entry));
+
+extern void aesd_circular_buffer_free(struct aesd_circular_buffer *buffer);
+
+extern uint32_t aesd_circular_buffer_count(const struct aesd_circular_buffer *buffer);
+
+extern size_t aesd_circular_buffer_total_size(const struct aesd_circular_buffer *buffer);
+
+extern struct aesd_buffer_entry *aesd_circular_buffer_get_entry(struct aesd_circular_buffer *buffer,
+            uint32_t n, size_t *char_offset_rtn);
+
+extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_for_seq(struct aesd_circular_buffer *buffer,
+            uint64_t seq, size_t *char_offset_rtn);
+
+/**
+ * @return the index following @param index in @param buffer, wrapping to 0
+ * without a division.
+ */
+static inline uint32_t aesd_circular_buffer_next(const struct aesd_circular_buffer *buffer, uint32_t index)
+{
+    return (index + 1 == buffer->capacity) ? 0 : index + 1;
+}
+
+/**
+ * @return the index in the entry array of the @param n th oldest entry of @param buffer.
+ */
+static inline uint32_t aesd_circular_buffer_slot(const struct aesd_circular_buffer *buffer, uint32_t n)
+{
+    uint32_t slot = buffer->out_offs + n;
+    return (slot >= buffer->capacity) ? slot - buffer->capacity : slot;
+}
+
 /**
  * Create a for loop to iterate over each member of the circular buffer.
  * Useful when you've allocated memory for circular buffer entries and need to free it
  * @param entryptr is a struct aesd_buffer_entry* to set with the current entry
  * @param buffer is the struct aesd_buffer * describing the buffer
- * @param index is a uint8_t stack allocated value used by this macro for an index
+ * @param index is a uint32_t stack allocated value used by this macro for an index
  * Example usage:
- * uint8_t index;
+ * uint32_t index;
  * struct aesd_circular_buffer buffer;
  * struct aesd_buffer_entry *entry;
  * AESD_CIRCULAR_BUFFER_FOREACH(entry,&buffer,index) {
@@ -74,7 +155,7 @@ extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
  */
 #define AESD_CIRCULAR_BUFFER_FOREACH(entryptr,buffer,index) \
     for(index=0, entryptr=&((buffer)->entry[index]); \
-            index<AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; \
+            index<(buffer)->capacity; \
             index++, entryptr=&((buffer)->entry[index]))
 
 
@@ -0,0 +1,163 @@
+/**
+ * @file aesd-spmc-ring.c
+ * @brief Lock-free single producer, multiple consumer ring of buffer entries
+ *
+ * See struct aesd_spmc_ring for the protocol.
+ */
+
+#ifdef __KERNEL__
+#include <linux/errno.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/compiler.h>
+#include <asm/barrier.h>
+#define AESD_RING_ALLOC(n) kvcalloc(n, sizeof(struct aesd_buffer_entry), GFP_KERNEL)
+#define AESD_RING_FREE(p) kvfree(p)
+#define AESD_READ_ONCE(x) READ_ONCE(x)
+#define AESD_WRITE_ONCE(x, v) WRITE_ONCE(x, v)
+#define aesd_load_acquire(p) smp_load_acquire(p)
+#define aesd_store_release(p, v) smp_store_release(p, v)
+#define aesd_smp_wmb() smp_wmb()
+#define aesd_smp_rmb() smp_rmb()
+#else
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#define AESD_RING_ALLOC(n) calloc(n, sizeof(struct aesd_buffer_entry))
+#define AESD_RING_FREE(p) free(p)
+// relaxed atomics, so racing slot copies are not undefined behaviour.
+#define AESD_READ_ONCE(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define AESD_WRITE_ONCE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+#define aesd_load_acquire(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define aesd_store_release(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define aesd_smp_wmb() __atomic_thread_fence(__ATOMIC_RELEASE)
+#define aesd_smp_rmb() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#endif
+
+#include "aesd-spmc-ring.h"
+
+/**
+* Initializes @param ring to hold the last @param capacity entries, rounded up
+* to a power of two so slots are found with a mask.
+* @return 0 on success, -EINVAL for a capacity outside 1..AESDCHAR_MAX_CAPACITY or
+* -ENOMEM if the slots could not be allocated.
+*/
+int aesd_spmc_ring_init(struct aesd_spmc_ring *ring, uint32_t capacity)
+{
+    uint32_t slots = 1;
+
+    memset(ring, 0, sizeof(*ring));
+    if (capacity == 0 || capacity > AESDCHAR_MAX_CAPACITY) return -EINVAL;
+    while (slots < capacity) slots <<= 1;
+
+    ring->slots = AESD_RING_ALLOC(slots);
+    if (!ring->slots) return -ENOMEM;
+    ring->capacity = slots;
+    ring->mask = slots - 1;
+    return 0;
+}
+
+/**
+* Releases the slots of @param ring. No consumer may be using it.
+* Memory referenced by the entries must be released by the caller first.
+*/
+void aesd_spmc_ring_free(struct aesd_spmc_ring *ring)
+{
+    AESD_RING_FREE(ring->slots);
+    ring->slots = NULL;
+}
+
+/**
+* Adds @param add_entry as the newest entry, overwriting the oldest one once
+* the ring is full. Its offset and seq are set as by aesd_circular_buffer_add_entry().
+* Only one producer may call this at a time.
+* @param evicted_rtn receives the overwritten entry, so the caller can release its
+*      memory once no consumer can be copying it any more.
+* @return true if an entry was overwritten.
+*/
+bool aesd_spmc_ring_push(struct aesd_spmc_ring *ring, const struct aesd_buffer_entry *add_entry,
+            struct aesd_buffer_entry *evicted_rtn)
+{
+    uint64_t head = ring->head;
+    struct aesd_buffer_entry *slot = &ring->slots[head & ring->mask];
+    bool evicted = false;
+
+    if (head - ring->tail == ring->capacity) {
+        *evicted_rtn = *slot;
+        evicted = true;
+        // consumers check tail after copying a slot, so it must move before the slot changes.
+        AESD_WRITE_ONCE(ring->tail, ring->tail + 1);
+        aesd_smp_wmb();
+    }
+
+    AESD_WRITE_ONCE(slot->buffptr, add_entry->buffptr);
+    AESD_WRITE_ONCE(slot->size, add_entry->size);
+    AESD_WRITE_ONCE(slot->offset, ring->bytes_added);
+    AESD_WRITE_ONCE(slot->seq, head);
+    ring->bytes_added += add_entry->size;
+
+    aesd_store_release(&ring->head, head + 1);
+    return evicted;
+}
+
+/**
+* Copies the entry numbered @param seq into @param entry_rtn.
+* @return 0 on success, -EAGAIN if it has not been added yet, or -ENOENT if it
+* has already been overwritten.
+*/
+int aesd_spmc_ring_get(const struct aesd_spmc_ring *ring, uint64_t seq,
+            struct aesd_buffer_entry *entry_rtn)
+{
+    const struct aesd_buffer_entry *slot = &ring->slots[seq & ring->mask];
+
+    // pairs with the release in push: the slot is filled in for every seq below head.
+    if (seq >= aesd_load_acquire(&ring->head)) return -EAGAIN;
+    if (seq < AESD_READ_ONCE(ring->tail)) return -ENOENT;
+
+    entry_rtn->buffptr = AESD_READ_ONCE(slot->buffptr);
+    entry_rtn->size = AESD_READ_ONCE(slot->size);
+    entry_rtn->offset = AESD_READ_ONCE(slot->offset);
+    entry_rtn->seq = AESD_READ_ONCE(slot->seq);
+
+    // pairs with the wmb in push: if the copy saw any newer write, tail has moved past seq.
+    aesd_smp_rmb();
+    if (seq < AESD_READ_ONCE(ring->tail)) return -ENOENT;
+    return 0;
+}
+
+/**
+* Copies the next entry for @param reader into @param entry_rtn and advances its cursor.
+* If the producer overwrote the entry at the cursor before it could be read,
+* the cursor skips to the oldest entry held and the skipped entries are added
+* to reader->lost.
+* @return 0 on success, or -EAGAIN if the reader has seen every entry added.
+*/
+int aesd_spmc_ring_read(const struct aesd_spmc_ring *ring, struct aesd_spmc_reader *reader,
+            struct aesd_buffer_entry *entry_rtn)
+{
+    int ret;
+
+    while ((ret = aesd_spmc_ring_get(ring, reader->cursor, entry_rtn)) == -ENOENT) {
+        uint64_t tail = AESD_READ_ONCE(ring->tail);
+        reader->lost += tail - reader->cursor;
+        reader->cursor = tail;
+    }
+    if (ret == 0) reader->cursor++;
+    return ret;
+}
+
+/**
+* @return the sequence number the next entry added to @param ring will get.
+*/
+uint64_t aesd_spmc_ring_head(const struct aesd_spmc_ring *ring)
+{
+    return aesd_load_acquire(&ring->head);
+}
+
+/**
+* @return the sequence number of the oldest entry still held by @param ring.
+*/
+uint64_t aesd_spmc_ring_tail(const struct aesd_spmc_ring *ring)
+{
+    return AESD_READ_ONCE(ring->tail);
+}
@@ -0,0 +1,100 @@
+/*
+ * aesd-spmc-ring.h
+ *
+ * Lock-free single producer, multiple consumer companion to
+ * aesd-circular-buffer.h. Builds for the kernel and for userspace, but only
+ * the userspace benchmarks link it until the driver has a caller; 64-bit
+ * kernels only, see struct aesd_spmc_ring.
+ */
+
+#ifndef AESD_SPMC_RING_H
+#define AESD_SPMC_RING_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/cache.h>
+#define AESD_CACHELINE_ALIGNED ____cacheline_aligned_in_smp
+#else
+#include <stddef.h> // size_t
+#include <stdint.h> // uintx_t
+#include <stdbool.h>
+#define AESD_CACHELINE_ALIGNED __attribute__((aligned(64)))
+#endif
+
+#include "aesd-circular-buffer.h"
+
+/**
+ * A ring of the most recent entries, written by one producer and read by any
+ * number of consumers without a lock.
+ *
+ * Entries are numbered by a 64-bit sequence that never wraps: the ring holds
+ * seq tail..head-1 in slots[seq & mask]. The producer publishes a new entry by
+ * advancing head with release ordering, after advancing tail past the entry
+ * it overwrites. Consumers copy an entry and then check tail again: if the
+ * producer reached the slot meanwhile, the copy is discarded. Consumers never
+ * write to the ring, so any number of them can read the same entry.
+ *
+ * Only the entry descriptors are protected. Memory referenced by buffptr must
+ * stay valid until no consumer can still be copying the entry that pointed at
+ * it, e.g. by freeing it after an RCU grace period in the kernel.
+ *
+ * The producer must be serialized by the caller. 64-bit counters are read
+ * with single loads, so 32-bit kernels are not supported.
+ */
+struct aesd_spmc_ring
+{
+    /**
+     * Set at init, read only afterwards. capacity is a power of two.
+     */
+    struct aesd_buffer_entry *slots;
+    uint32_t capacity;
+    uint32_t mask;
+
+    /**
+     * Published by the producer and polled by consumers, on a line of their own
+     * so consumer loads of head and tail do not contend with the fields above.
+     * head is the sequence number the next entry gets, tail the oldest one held.
+     */
+    uint64_t head AESD_CACHELINE_ALIGNED;
+    uint64_t tail;
+
+    /**
+     * Only touched by the producer.
+     */
+    size_t bytes_added AESD_CACHELINE_ALIGNED;
+};
+
+/**
+ * A consumer's position, padded to a cache line so consumers polling side by
+ * side do not share one.
+ */
+struct aesd_spmc_reader
+{
+    /**
+     * Sequence number of the next entry to read
+     */
+    uint64_t cursor;
+    /**
+     * Entries skipped because the producer overwrote them before they were read
+     */
+    uint64_t lost;
+} AESD_CACHELINE_ALIGNED;
+
+extern int aesd_spmc_ring_init(struct aesd_spmc_ring *ring, uint32_t capacity);
+
+extern void aesd_spmc_ring_free(struct aesd_spmc_ring *ring);
+
+extern bool aesd_spmc_ring_push(struct aesd_spmc_ring *ring, const struct aesd_buffer_entry *add_entry,
+            struct aesd_buffer_entry *evicted_rtn);
+
+extern int aesd_spmc_ring_get(const struct aesd_spmc_ring *ring, uint64_t seq,
+            struct aesd_buffer_entry *entry_rtn);
+
+extern int aesd_spmc_ring_read(const struct aesd_spmc_ring *ring, struct aesd_spmc_reader *reader,
+            struct aesd_buffer_entry *entry_rtn);
+
+extern uint64_t aesd_spmc_ring_head(const struct aesd_spmc_ring *ring);
+
+extern uint64_t aesd_spmc_ring_tail(const struct aesd_spmc_ring *ring);
+
+#endif /* AESD_SPMC_RING_H */
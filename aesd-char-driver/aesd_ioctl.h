@@ -33,14 +33,163 @@ struct aesd_seekto {
     uint32_t write_cmd_offset;
 };
 
+/**
+ * One record of an AESDCHAR_IOCAPPEND batch
+ */
+struct aesd_record {
+    /**
+     * User pointer to the record bytes
+     */
+    uint64_t data;
+    /**
+     * Length of the record, 1..AESDCHAR_RECORD_MAX
+     */
+    uint32_t len;
+    uint32_t reserved;
+};
+
+/**
+ * Argument of AESDCHAR_IOCAPPEND
+ */
+struct aesd_append {
+    /**
+     * User pointer to an array of count struct aesd_record
+     */
+    uint64_t records;
+    /**
+     * Number of records, 1..AESDCHAR_APPEND_MAX
+     */
+    uint32_t count;
+    /**
+     * Set to the number of records committed, always count on success
+     */
+    uint32_t committed;
+    /**
+     * Set to the sequence number of the first record; record i is first_seq + i.
+     * Sequence numbers count every write committed since the device was loaded, from 0.
+     */
+    uint64_t first_seq;
+};
+
+#define AESDCHAR_APPEND_MAX 4096
+/* every record is copied in before the device is locked, so both are bounded */
+#define AESDCHAR_RECORD_MAX (1 << 20)
+#define AESDCHAR_APPEND_MAX_BYTES (16 << 20)
+
+/**
+ * Argument of AESDCHAR_IOCSEEKSEQ
+ */
+struct aesd_seekseq {
+    /**
+     * Sequence number of the first write to read, e.g. one past the last one consumed
+     */
+    uint64_t seq;
+    /**
+     * Set to the sequence number of the write now at the file position
+     */
+    uint64_t found_seq;
+    /**
+     * Set to AESD_SEEKSEQ_EVICTED when writes seq..found_seq - 1 were already evicted
+     */
+    uint32_t flags;
+    uint32_t reserved;
+};
+
+#define AESD_SEEKSEQ_EVICTED 0x1
+
+/**
+ * Layout of the first page of an mmap() of the aesdchar device. The data ring
+ * follows at data_offset and holds the most recent data_size bytes of the
+ * concatenated writes; the byte at stream offset x is at data[x & (data_size - 1)].
+ * Stream offsets are those of aesd_buffer_entry.offset, i.e. bytes ever written.
+ *
+ * The kernel makes update_seq odd while it changes the ring. A reader copies
+ * [tail, head) and retries if update_seq was odd or changed meanwhile:
+ *
+ *     do {
+ *         seq = __atomic_load_n(&hdr->update_seq, __ATOMIC_ACQUIRE);
+ *         ... read head and tail, copy the bytes ...
+ *         __atomic_thread_fence(__ATOMIC_ACQUIRE);
+ *     } while ((seq & 1) || seq != hdr->update_seq);
+ *
+ * When more history is stored than fits in the ring, tail may fall inside a
+ * write; readers skip up to the next newline.
+ *
+ * The view only exists when the module is loaded with aesd_mmap_size set;
+ * mmap() fails with ENODEV otherwise.
+ */
+struct aesd_mmap_header {
+    uint32_t update_seq;
+    /**
+     * Offset of the data ring from the start of the mapping, in bytes
+     */
+    uint32_t data_offset;
+    /**
+     * Size of the data ring, a power of two
+     */
+    uint64_t data_size;
+    /**
+     * Stream offset one past the newest byte
+     */
+    uint64_t head;
+    /**
+     * Stream offset of the oldest byte still held by both the device and the ring
+     */
+    uint64_t tail;
+    /**
+     * Total number of writes committed since the device was loaded
+     */
+    uint64_t entries_committed;
+    /**
+     * Mirrors of the circular buffer in_offs and out_offs
+     */
+    uint32_t in_offs;
+    uint32_t out_offs;
+};
+
 // Pick an arbitrary unused value from https://github.com/torvalds/linux/blob/master/Documentation/userspace-api/ioctl/ioctl-number.rst
 #define AESD_IOC_MAGIC 0x16
 
 // Define a write command from the user point of view, use command number 1
 #define AESDCHAR_IOCSEEKTO _IOWR(AESD_IOC_MAGIC, 1, struct aesd_seekto)
+/**
+ * Change the number of writes retained by the device. The argument is a uint32_t
+ * in 1..65536; shrinking discards the oldest writes. Fails with EPERM unless the
+ * file is open for writing or the caller has CAP_SYS_ADMIN.
+ */
+#define AESDCHAR_IOCRESIZE _IOW(AESD_IOC_MAGIC, 2, uint32_t)
+/**
+ * Switch this open file into (nonzero) or out of (zero) follow mode. In follow
+ * mode the file tracks a stream offset rather than a position relative to the
+ * oldest write, so writes evicted while it reads are skipped instead of shifting
+ * its position, and a read with nothing new to return blocks until the next write
+ * is committed (or fails with EAGAIN under O_NONBLOCK) instead of returning 0.
+ * poll() then reports the file readable only once a write lands past its position,
+ * and lseek() takes and returns stream offsets, as in struct aesd_mmap_header,
+ * moving a position that was evicted up to the oldest byte still held. The
+ * offsets given to pread() and splice() are stream offsets too, so one file in
+ * follow mode can serve positional reads of a fixed range for any number of
+ * readers while older writes are evicted.
+ */
+#define AESDCHAR_IOCFOLLOW _IOW(AESD_IOC_MAGIC, 3, uint32_t)
+/**
+ * Commit each record of a struct aesd_append as a write of its own, in order and
+ * in one lock acquisition. Records are stored verbatim: no newline is added or
+ * looked for, and a partial line pending on the file is left alone. Fails with
+ * EINVAL if a record is longer than AESDCHAR_RECORD_MAX or all of them together
+ * exceed AESDCHAR_APPEND_MAX_BYTES.
+ */
+#define AESDCHAR_IOCAPPEND _IOWR(AESD_IOC_MAGIC, 4, struct aesd_append)
+/**
+ * Move the file position to the oldest write whose sequence number is at least
+ * seq, numbered as for AESDCHAR_IOCAPPEND. A seq equal to the number of writes
+ * so far positions the file at the end; a larger one, e.g. saved before the
+ * module was reloaded, fails with EINVAL.
+ */
+#define AESDCHAR_IOCSEEKSEQ _IOWR(AESD_IOC_MAGIC, 5, struct aesd_seekseq)
 /**
  * The maximum number of commands supported, used for bounds checking
  */
-#define AESDCHAR_IOC_MAXNR 1
+#define AESDCHAR_IOC_MAXNR 5
 
 #endif /* AESD_IOCTL_H */
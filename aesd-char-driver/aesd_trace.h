@@ -0,0 +1,94 @@
+/*
+ * aesd_trace.h
+ *
+ * Static tracepoints of the aesdchar driver, under events/aesdchar in tracefs:
+ *
+ *   echo 1 > /sys/kernel/tracing/events/aesdchar/enable
+ *   perf record -e 'aesdchar:*' ...
+ *
+ * Disabled tracepoints cost a patched-out branch, unlike PDEBUG.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM aesdchar
+
+#if !defined(AESD_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define AESD_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/*
+ * A line was linked into the circular buffer of device @index as entry @seq,
+ * at stream offset @offset.
+ */
+TRACE_EVENT(aesd_commit,
+    TP_PROTO(unsigned int index, u64 seq, u64 offset, size_t size),
+    TP_ARGS(index, seq, offset, size),
+    TP_STRUCT__entry(
+        __field(unsigned int, index)
+        __field(u64, seq)
+        __field(u64, offset)
+        __field(size_t, size)
+    ),
+    TP_fast_assign(
+        __entry->index = index;
+        __entry->seq = seq;
+        __entry->offset = offset;
+        __entry->size = size;
+    ),
+    TP_printk("dev=%u seq=%llu offset=%llu size=%zu", __entry->index,
+        __entry->seq, __entry->offset, __entry->size)
+);
+
+/*
+ * Entry @seq of device @index made room for a newer one.
+ */
+TRACE_EVENT(aesd_evict,
+    TP_PROTO(unsigned int index, u64 seq, size_t size),
+    TP_ARGS(index, seq, size),
+    TP_STRUCT__entry(
+        __field(unsigned int, index)
+        __field(u64, seq)
+        __field(size_t, size)
+    ),
+    TP_fast_assign(
+        __entry->index = index;
+        __entry->seq = seq;
+        __entry->size = size;
+    ),
+    TP_printk("dev=%u seq=%llu size=%zu", __entry->index, __entry->seq, __entry->size)
+);
+
+/*
+ * A read of device @index starting at @pos, a stream offset if @follow is
+ * set, asked for @count bytes and returned @ret.
+ */
+TRACE_EVENT(aesd_read,
+    TP_PROTO(unsigned int index, loff_t pos, bool follow, size_t count, ssize_t ret),
+    TP_ARGS(index, pos, follow, count, ret),
+    TP_STRUCT__entry(
+        __field(unsigned int, index)
+        __field(loff_t, pos)
+        __field(bool, follow)
+        __field(size_t, count)
+        __field(ssize_t, ret)
+    ),
+    TP_fast_assign(
+        __entry->index = index;
+        __entry->pos = pos;
+        __entry->follow = follow;
+        __entry->count = count;
+        __entry->ret = ret;
+    ),
+    TP_printk("dev=%u pos=%lld follow=%d count=%zu ret=%zd", __entry->index,
+        __entry->pos, __entry->follow, __entry->count, __entry->ret)
+);
+
+#endif /* AESD_TRACE_H */
+
+/* this part must be outside the include guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE aesd_trace
+#include <trace/define_trace.h>
@@ -9,8 +9,17 @@
 #define AESD_CHAR_DRIVER_AESDCHAR_H_
 
 #include "aesd-circular-buffer.h"
+#include "aesd_ioctl.h"
+#ifdef __KERNEL__
+#include <linux/atomic.h>
+#include <linux/percpu.h>
+#include <linux/mutex.h>
+#include <linux/seqlock.h>
+#include <linux/rcupdate.h>
+#include <linux/wait.h>
+#endif
 
-#define AESD_DEBUG 1  //Remove comment on this line to enable debug
+//#define AESD_DEBUG 1  //Remove comment on this line to enable debug
 
 #undef PDEBUG             /* undef it, just in case */
 #ifdef AESD_DEBUG
@@ -21,15 +30,93 @@
      /* This one for user space */
 #    define PDEBUG(fmt, args...) fprintf(stderr, fmt, ## args)
 #  endif
+#elif defined(__KERNEL__)
+   /* off until enabled at runtime: echo 'module aesdchar +p' > /sys/kernel/debug/dynamic_debug/control */
+#  define PDEBUG(fmt, args...) pr_debug("aesdchar: " fmt, ## args)
 #else
 #  define PDEBUG(fmt, args...) /* not debugging: nothing */
 #endif
 
+/**
+ * Memory behind every entry buffptr and partial line, outside arena mode for
+ * the former. Entries evicted from the circular buffer are freed after an
+ * SRCU grace period, since lockless readers may still be copying from them.
+ */
+struct aesd_blob
+{
+    struct rcu_head rcu;
+    unsigned int size_class;  /* slab cache the blob came from, or AESD_BLOB_KMALLOC */
+    char data[];
+};
+
+/**
+ * Per device counters, shown in debugfs as aesdchar/<index>/stats. Bytes and
+ * entries written are the bytes_added and entries_added of the buffer.
+ */
+struct aesd_stats
+{
+    /* updated with dev->lock held */
+    u64 evictions;            /* entries dropped to make room for newer ones */
+    u64 lock_waits;           /* commits that found dev->lock taken */
+    u64 lock_wait_ns;         /* time those commits waited for it */
+    atomic_long_t partial_bytes;  /* bytes of unterminated lines, in files and parked */
+};
+
+/**
+ * Read side counters, per CPU since readers do not take dev->lock
+ */
+struct aesd_read_stats
+{
+    u64 reads;
+    u64 read_bytes;
+};
+
+/**
+ * A line being accumulated until its terminating newline arrives
+ */
+struct aesd_line
+{
+    char *buf;
+    size_t len;           /* bytes of buf in use */
+    size_t cap;           /* bytes allocated for buf */
+};
+
 struct aesd_dev
 {
     struct cdev cdev;     /* Char device structure      */
-    struct mutex lock;
+    struct mutex lock;    /* serializes writers linking lines into cb */
+    seqcount_mutex_t seq; /* lets readers detect a concurrent change to cb */
     struct aesd_circular_buffer cb;
+    struct aesd_line parked;  /* partial line left behind by a closed file */
+    /*
+     * With aesd_arena_size set, line bytes live here in stream order, entry
+     * N at arena[offset & (arena_size - 1)] with a NULL buffptr, and the
+     * entries held never span more than arena_size bytes. NULL otherwise.
+     */
+    char *arena;
+    size_t arena_size;
+    /* read-only mmap() view: a header page followed by a data ring, NULL if disabled */
+    struct aesd_mmap_header *mmap_hdr;
+    char *mmap_data;
+    wait_queue_head_t readq;  /* follow mode readers waiting for a new write */
+    unsigned int index;       /* minor is aesd_minor + index */
+    struct aesd_stats stats;
+    struct aesd_read_stats __percpu *read_stats;
+    struct dentry *debugfs;   /* aesdchar/<index> */
+};
+
+/**
+ * Per open file state, stored in filp->private_data
+ */
+struct aesd_file_data
+{
+    struct aesd_dev *dev;
+    struct mutex write_lock;  /* serializes writes through this file */
+    struct aesd_line partial; /* partial line written through this file */
+    /* completed lines of the current write not yet linked into dev->cb, at most AESD_STAGED_MAX_LINES */
+    struct aesd_buffer_entry *staged;
+    size_t staged_cap;
+    bool follow;              /* set by AESDCHAR_IOCFOLLOW; f_pos is then a stream offset */
 };
 
 
@@ -21,190 +21,1153 @@
 #include "aesd_ioctl.h"
 
 #include <linux/slab.h>
+#include <linux/uaccess.h> // copy_*_user, get_user
+#include <linux/srcu.h>
+#include <linux/uio.h> // iov_iter
+#include <linux/version.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/log2.h>
+#include <linux/poll.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
+#include <linux/percpu.h>
+#include <linux/capability.h>
 
-#define TEMP_BUFFER_SIZE 0
+#define CREATE_TRACE_POINTS
+#include "aesd_trace.h"
+
+/* upper bound on aesd_nr_devs */
+#define AESD_MAX_DEVICES 64
+
+/* smallest allocation used for a partial line */
+#define AESD_LINE_MIN_CAP 64
+
+/* smallest array of lines staged by one write */
+#define AESD_STAGED_MIN_CAP 16
+/* a write links its lines into the ring in batches of at most this many lines or bytes */
+#define AESD_STAGED_MAX_LINES 64
+#define AESD_STAGED_MAX_BYTES (64 * 1024)
+
+/* blobs of up to 64 << (AESD_BLOB_CLASSES - 1) bytes come from per-size-class slab caches */
+#define AESD_BLOB_MIN_SHIFT 6
+#define AESD_BLOB_CLASSES 7
+/* size_class of a blob from kmalloc, e.g. a partial line or a line too long for the caches */
+#define AESD_BLOB_KMALLOC AESD_BLOB_CLASSES
 
 int aesd_major =   0; // use dynamic major
 int aesd_minor =   0;
+unsigned int aesd_nr_devs = 1;
+unsigned int aesd_capacity = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+
+unsigned long aesd_mmap_size;
+bool aesd_pool = true;
+unsigned long aesd_arena_size;
+
+module_param(aesd_nr_devs, uint, 0444);
+MODULE_PARM_DESC(aesd_nr_devs, "Number of independent devices, each with its own buffer and lock (default 1)");
+module_param(aesd_capacity, uint, 0444);
+MODULE_PARM_DESC(aesd_capacity, "Number of writes retained by the device (default 10)");
+module_param(aesd_mmap_size, ulong, 0444);
+MODULE_PARM_DESC(aesd_mmap_size, "Bytes of history exposed through mmap, rounded up to a power of two. The view is a second copy of every line, made under the device lock (default 0, mmap disabled)");
+module_param(aesd_pool, bool, 0444);
+MODULE_PARM_DESC(aesd_pool, "Allocate written lines from per-size-class slab caches rather than kmalloc (default Y)");
+module_param(aesd_arena_size, ulong, 0444);
+MODULE_PARM_DESC(aesd_arena_size, "Bytes of history kept in one contiguous ring per device, rounded up to a power of two (0 allocates each line separately)");
+
+static atomic_long_t aesd_pool_allocs;
+static atomic_long_t aesd_kmalloc_allocs;
+
+static int aesd_param_get_counter(char *buffer, const struct kernel_param *kp)
+{
+    return sprintf(buffer, "%ld\n", atomic_long_read((atomic_long_t *)kp->arg));
+}
+
+static const struct kernel_param_ops aesd_counter_ops = {
+    .get = aesd_param_get_counter,
+};
+
+module_param_cb(pool_allocs, &aesd_counter_ops, &aesd_pool_allocs, 0444);
+MODULE_PARM_DESC(pool_allocs, "Blobs allocated from the size-class caches");
+module_param_cb(kmalloc_allocs, &aesd_counter_ops, &aesd_kmalloc_allocs, 0444);
+MODULE_PARM_DESC(kmalloc_allocs, "Blobs allocated or grown with kmalloc");
 
 MODULE_AUTHOR("Arslan Ahmad");
 MODULE_LICENSE("Dual BSD/GPL");
 
-struct aesd_dev aesd_device;
-char * temp_buffer = NULL;
-size_t temp_buffer_size = 0;
+/* aesd_nr_devs independent devices, minors aesd_minor onwards */
+struct aesd_dev *aesd_devices;
+
+/* aesdchar/ in debugfs, NULL if debugfs is unavailable */
+static struct dentry *aesd_debugfs_root;
+
+/*
+ * Readers walk the circular buffer without dev->lock. They hold this SRCU
+ * read lock, which unlike plain RCU allows copy_to_user() to sleep, while
+ * the memory they use is kept alive until a grace period has elapsed.
+ */
+DEFINE_STATIC_SRCU(aesd_srcu);
+
+/*
+ * A steady stream of short lines allocates and, on eviction, frees one blob
+ * per write. Power-of-two caches keep that churn on slab freelists of their own.
+ */
+static struct kmem_cache *aesd_blob_cache[AESD_BLOB_CLASSES];
+static char aesd_blob_cache_name[AESD_BLOB_CLASSES][24];
+
+static inline struct aesd_blob *aesd_blob_of(const char *buffptr)
+{
+    return buffptr ? container_of((char *)buffptr, struct aesd_blob, data[0]) : NULL;
+}
+
+/**
+ * Allocates a blob for a completed line of @param size bytes, from the
+ * smallest size-class cache it fits in when there is one.
+ */
+static char *aesd_blob_alloc(size_t size)
+{
+    size_t total = sizeof(struct aesd_blob) + size;
+    unsigned int size_class = 0;
+    struct aesd_blob *blob;
+
+    if (total > (1 << AESD_BLOB_MIN_SHIFT)) size_class = order_base_2(total) - AESD_BLOB_MIN_SHIFT;
+    if (size_class < AESD_BLOB_CLASSES && aesd_blob_cache[size_class]) {
+        blob = kmem_cache_alloc(aesd_blob_cache[size_class], GFP_KERNEL);
+        atomic_long_inc(&aesd_pool_allocs);
+    } else {
+        size_class = AESD_BLOB_KMALLOC;
+        blob = kmalloc(total, GFP_KERNEL);
+        atomic_long_inc(&aesd_kmalloc_allocs);
+    }
+    if (!blob) return NULL;
+    blob->size_class = size_class;
+    return blob->data;
+}
+
+/**
+ * Resizes a kmalloc blob, as used for partial lines, to hold @param size bytes.
+ * @return the new data pointer, or NULL with @param buffptr left untouched.
+ */
+static char *aesd_blob_realloc(char *buffptr, size_t size)
+{
+    struct aesd_blob *blob = krealloc(aesd_blob_of(buffptr), sizeof(*blob) + size, GFP_KERNEL);
+
+    if (!blob) return NULL;
+    atomic_long_inc(&aesd_kmalloc_allocs);
+    blob->size_class = AESD_BLOB_KMALLOC;
+    return blob->data;
+}
+
+static void aesd_blob_release(struct aesd_blob *blob)
+{
+    if (blob && blob->size_class != AESD_BLOB_KMALLOC) {
+        kmem_cache_free(aesd_blob_cache[blob->size_class], blob);
+    } else {
+        kfree(blob);
+    }
+}
+
+/**
+ * Frees a blob no reader can reach, e.g. a partial line.
+ */
+static void aesd_blob_free(const char *buffptr)
+{
+    aesd_blob_release(aesd_blob_of(buffptr));
+}
+
+static void aesd_blob_free_rcu(struct rcu_head *head)
+{
+    aesd_blob_release(container_of(head, struct aesd_blob, rcu));
+}
+
+static int aesd_blob_cache_init(void)
+{
+    unsigned int i;
+
+    if (!aesd_pool) return 0;
+    for (i = 0; i < AESD_BLOB_CLASSES; i++) {
+        size_t size = 1 << (AESD_BLOB_MIN_SHIFT + i);
+
+        snprintf(aesd_blob_cache_name[i], sizeof(aesd_blob_cache_name[i]), "aesd_blob_%zu", size);
+        /* reads and AESDCHAR_IOCAPPEND copy line data straight to and from blobs */
+        aesd_blob_cache[i] = kmem_cache_create_usercopy(aesd_blob_cache_name[i], size, 0, 0,
+                offsetof(struct aesd_blob, data), size - offsetof(struct aesd_blob, data), NULL);
+        if (!aesd_blob_cache[i]) return -ENOMEM;
+    }
+    return 0;
+}
+
+/**
+ * Destroys the caches, after every deferred free has run.
+ */
+static void aesd_blob_cache_destroy(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < AESD_BLOB_CLASSES; i++) {
+        kmem_cache_destroy(aesd_blob_cache[i]);
+        aesd_blob_cache[i] = NULL;
+    }
+}
+
+/**
+ * Frees a blob that was reachable from the circular buffer once current readers are done.
+ */
+static void aesd_blob_free_deferred(const char *buffptr)
+{
+    if (buffptr) call_srcu(&aesd_srcu, &aesd_blob_of(buffptr)->rcu, aesd_blob_free_rcu);
+}
 
 int aesd_open(struct inode *inode, struct file *filp)
 {
-    PDEBUG("open");
+    PDEBUG("open\n");
     
-    struct aesd_dev *dev;
-    dev = container_of(inode->i_cdev, struct aesd_dev, cdev);
-    filp->private_data = dev;
+    struct aesd_file_data *fdata;
+    fdata = kzalloc(sizeof(*fdata), GFP_KERNEL);
+    if (!fdata) return -ENOMEM;
+    fdata->dev = container_of(inode->i_cdev, struct aesd_dev, cdev);
+    mutex_init(&fdata->write_lock);
+    filp->private_data = fdata;
 
     return 0;
 }
 
 int aesd_release(struct inode *inode, struct file *filp)
 {
-    PDEBUG("release");
+    PDEBUG("release\n");
+
+    struct aesd_file_data *fdata = filp->private_data;
+    struct aesd_dev *dev = fdata->dev;
+    struct aesd_line *parked = &dev->parked;
+
+    /*
+     * Keep an unterminated line for the next writer, so a line may still be
+     * built from several opens (echo -n "abc" > dev; echo "def" > dev).
+     */
+    if (fdata->partial.len) {
+        mutex_lock(&dev->lock);
+        if (!parked->buf) {
+            *parked = fdata->partial;
+            fdata->partial.buf = NULL;
+        } else {
+            char *buf = aesd_blob_realloc(parked->buf, parked->len + fdata->partial.len);
+            if (buf) {
+                memcpy(buf + parked->len, fdata->partial.buf, fdata->partial.len);
+                parked->buf = buf;
+                parked->len += fdata->partial.len;
+                parked->cap = parked->len;
+            } else {
+                atomic_long_sub(fdata->partial.len, &dev->stats.partial_bytes);
+            }
+        }
+        mutex_unlock(&dev->lock);
+    }
+    aesd_blob_free(fdata->partial.buf);
+    kvfree(fdata->staged);
+    mutex_destroy(&fdata->write_lock);
+    kfree(fdata);
 
     return 0;
 }
 
-ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
-                loff_t *f_pos)
+/**
+ * Copies the fields of @param src needed for lookups, without its inline entries.
+ * The result is only consistent if the caller's seqcount read section succeeds.
+ */
+static void aesd_cb_snapshot(struct aesd_circular_buffer *dst, const struct aesd_circular_buffer *src)
 {
-    ssize_t retval = 0;
-    PDEBUG("read %zu bytes with offset %lld",count,*f_pos);
+    dst->entry = READ_ONCE(src->entry);
+    dst->capacity = READ_ONCE(src->capacity);
+    dst->in_offs = READ_ONCE(src->in_offs);
+    dst->out_offs = READ_ONCE(src->out_offs);
+    dst->full = READ_ONCE(src->full);
+    dst->bytes_added = READ_ONCE(src->bytes_added);
+}
 
-    struct aesd_dev *dev = filp->private_data;
-    struct aesd_circular_buffer *cb = &dev->cb;
+/**
+ * Finds the entry covering @param pos, retrying until no writer changed the
+ * buffer meanwhile. Must be called inside an aesd_srcu read section, which
+ * keeps the returned buffptr valid even if the entry is evicted.
+ * @param pos a stream offset. One whose bytes were evicted is moved up to the
+ * oldest byte still held.
+ * @return true and fills @param entry and @param entry_offset_byte, or false
+ * if @param pos is past the end of the data.
+ */
+static bool aesd_find_entry(struct aesd_dev *dev, loff_t *pos,
+                struct aesd_buffer_entry *entry, size_t *entry_offset_byte)
+{
+    struct aesd_circular_buffer snap;
     struct aesd_buffer_entry *dptr = NULL;
+    loff_t want, base;
+    unsigned int seq;
+
+    do {
+        seq = read_seqcount_begin(&dev->seq);
+        aesd_cb_snapshot(&snap, &dev->cb);
+        if (read_seqcount_retry(&dev->seq, seq)) continue;
+
+        want = *pos;
+        base = snap.bytes_added - aesd_circular_buffer_total_size(&snap);
+        if (want < base) want = base;
+        dptr = aesd_circular_buffer_find_entry_offset_for_fpos(&snap, want - base, entry_offset_byte);
+        if (dptr) *entry = *dptr;
+    } while (read_seqcount_retry(&dev->seq, seq));
+
+    *pos = want;
+    return dptr != NULL;
+}
+
+/**
+ * Reads the stream offsets of the oldest byte held and one past the newest,
+ * retrying until no writer changed the buffer meanwhile. Must be called
+ * inside an aesd_srcu read section.
+ */
+static void aesd_stream_range(struct aesd_dev *dev, loff_t *base, loff_t *head)
+{
+    struct aesd_circular_buffer snap;
+    unsigned int seq;
+
+    do {
+        seq = read_seqcount_begin(&dev->seq);
+        aesd_cb_snapshot(&snap, &dev->cb);
+        if (read_seqcount_retry(&dev->seq, seq)) continue;
+
+        *head = snap.bytes_added;
+        *base = *head - aesd_circular_buffer_total_size(&snap);
+    } while (read_seqcount_retry(&dev->seq, seq));
+}
+
+/**
+ * Copies the bytes from @param pos onwards straight out of the arena, in one
+ * copy or two where they wrap, however many entries they span. Writers reuse
+ * arena bytes as soon as their entry is evicted, so the copy only counts if
+ * the oldest byte held has not moved past it meanwhile; otherwise it is
+ * undone and retried. Must be called inside an aesd_srcu read section.
+ * @param pos position relative to the oldest write or, if @param stream is set,
+ * a stream offset, moved up like aesd_find_entry() does; advanced past the
+ * bytes copied.
+ * @return bytes copied, 0 if @param pos is past the end of the data, or -EFAULT.
+ */
+static ssize_t aesd_arena_read(struct aesd_dev *dev, loff_t *pos, bool stream, struct iov_iter *to)
+{
+    size_t mask = dev->arena_size - 1;
+    size_t len, off, first, copied;
+    loff_t want, base, head;
+
+    for (;;) {
+        aesd_stream_range(dev, &base, &head);
+        want = stream ? max(*pos, base) : base + *pos;
+        if (want >= head) {
+            if (stream) *pos = want;
+            return 0;
+        }
+
+        len = min_t(loff_t, head - want, iov_iter_count(to));
+        off = want & mask;
+        first = min(len, dev->arena_size - off);
+        copied = copy_to_iter(dev->arena + off, first, to);
+        if (copied == first && len > first) copied += copy_to_iter(dev->arena, len - first, to);
+
+        // pairs with the write section aesd_arena_commit() overwrites evicted bytes in.
+        smp_rmb();
+        aesd_stream_range(dev, &base, &head);
+        if (base <= want) break;
+        iov_iter_revert(to, copied);
+    }
+
+    *pos = (stream ? want : *pos) + copied;
+    return copied ? copied : -EFAULT;
+}
+
+/**
+ * Stream offset one past the newest byte, for follow mode readers
+ */
+static loff_t aesd_stream_head(struct aesd_dev *dev)
+{
+    return READ_ONCE(dev->cb.bytes_added);
+}
+
+/**
+ * Copies as many consecutive entries as fit in @param to, so draining the
+ * device takes one call rather than one per write, and with an arena at most
+ * two copies. A file in follow mode waits for the next write rather than
+ * returning 0 once it has read everything.
+ */
+static ssize_t aesd_do_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct file *filp = iocb->ki_filp;
+    struct aesd_file_data *fdata = filp->private_data;
+    struct aesd_dev *dev = fdata->dev;
+    struct aesd_buffer_entry entry;
+    bool follow = fdata->follow;
+    loff_t pos = iocb->ki_pos;
     size_t entry_offset_byte;
-    size_t bytes_to_read;
-    
-    mutex_lock(&dev->lock);
+    size_t bytes_to_read, copied;
+    ssize_t retval = 0;
+    int idx;
 
-    dptr = aesd_circular_buffer_find_entry_offset_for_fpos(cb, *f_pos, &entry_offset_byte);
-    if (dptr == NULL){
-        retval = 0;
-        goto out;
+    PDEBUG("read %zu bytes with offset %lld\n", iov_iter_count(to), pos);
+    if (pos < 0) return -EINVAL;
+    if (!iov_iter_count(to)) return 0;
+
+    for (;;) {
+        idx = srcu_read_lock(&aesd_srcu);
+        if (dev->arena) {
+            retval = aesd_arena_read(dev, &pos, follow, to);
+        } else {
+            /*
+             * Each pass looks its entry up in a new snapshot, so work in
+             * stream offsets: a relative position would move on by a whole
+             * entry whenever one is evicted between two passes.
+             */
+            loff_t spos = pos, base, head;
+
+            if (!follow) {
+                aesd_stream_range(dev, &base, &head);
+                spos = base + pos;
+            }
+            while (iov_iter_count(to)) {
+                if (!aesd_find_entry(dev, &spos, &entry, &entry_offset_byte)) break;
+
+                bytes_to_read = min(entry.size - entry_offset_byte, iov_iter_count(to));
+                copied = copy_to_iter(entry.buffptr + entry_offset_byte, bytes_to_read, to);
+                spos += copied;
+                retval += copied;
+                if (copied != bytes_to_read) {
+                    if (!retval) retval = -EFAULT;
+                    break;
+                }
+            }
+            pos = follow ? spos : pos + max_t(ssize_t, retval, 0);
+        }
+        srcu_read_unlock(&aesd_srcu, idx);
+
+        if (retval || !follow) break;
+        if ((filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT)) return -EAGAIN;
+        // sleep outside the read section so a waiting reader never holds up a grace period.
+        if (wait_event_interruptible(dev->readq, aesd_stream_head(dev) > pos)) return -ERESTARTSYS;
     }
 
-    bytes_to_read = dptr->size - entry_offset_byte;
-    if (bytes_to_read > count)  bytes_to_read = count;
+    iocb->ki_pos = pos;
+    return retval;
+}
 
-    if (copy_to_user(buf, dptr->buffptr + entry_offset_byte, bytes_to_read)){
-        retval = -EFAULT;
-        goto out;
+/**
+ * Backs read(), readv() and splice(), counting and tracing every call.
+ */
+ssize_t aesd_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct aesd_file_data *fdata = iocb->ki_filp->private_data;
+    struct aesd_dev *dev = fdata->dev;
+    bool follow = fdata->follow;
+    loff_t pos = iocb->ki_pos;
+    size_t count = iov_iter_count(to);
+    ssize_t retval = aesd_do_read_iter(iocb, to);
+
+    this_cpu_inc(dev->read_stats->reads);
+    if (retval > 0) this_cpu_add(dev->read_stats->read_bytes, retval);
+    trace_aesd_read(dev->index, pos, follow, count, retval);
+    return retval;
+}
+
+/**
+ * Makes room for at least @param need bytes in @param line, growing the
+ * allocation geometrically so a long line costs O(log n) reallocations.
+ */
+static int aesd_line_reserve(struct aesd_line *line, size_t need)
+{
+    size_t cap;
+    char *buf;
+
+    if (need <= line->cap) return 0;
+    cap = max3(need, line->cap * 2, (size_t)AESD_LINE_MIN_CAP);
+    buf = aesd_blob_realloc(line->buf, cap);
+    if (!buf) return -ENOMEM;
+    line->buf = buf;
+    line->cap = cap;
+    return 0;
+}
+
+/**
+ * Brings the mmap header in line with dev->cb after a change. The caller
+ * has already bumped update_seq to an odd value. Must hold dev->lock.
+ */
+static void aesd_mmap_sync_header(struct aesd_dev *dev)
+{
+    struct aesd_mmap_header *hdr = dev->mmap_hdr;
+    uint64_t head = dev->cb.bytes_added;
+    uint64_t tail = head - aesd_circular_buffer_total_size(&dev->cb);
+
+    if (head - tail > hdr->data_size) tail = head - hdr->data_size;
+    hdr->head = head;
+    hdr->tail = tail;
+    hdr->entries_committed = dev->cb.entries_added;
+    hdr->in_offs = dev->cb.in_offs;
+    hdr->out_offs = dev->cb.out_offs;
+}
+
+static void aesd_mmap_begin_update(struct aesd_mmap_header *hdr)
+{
+    WRITE_ONCE(hdr->update_seq, hdr->update_seq + 1);
+    smp_wmb();
+}
+
+static void aesd_mmap_end_update(struct aesd_mmap_header *hdr)
+{
+    smp_wmb();
+    WRITE_ONCE(hdr->update_seq, hdr->update_seq + 1);
+}
+
+/**
+ * Appends a committed line to the mmap data ring. Must hold dev->lock.
+ */
+static void aesd_mmap_append(struct aesd_dev *dev, const char *buffptr, size_t size)
+{
+    struct aesd_mmap_header *hdr = dev->mmap_hdr;
+    size_t mask, pos, first;
+
+    if (!hdr) return;
+    mask = hdr->data_size - 1;
+    // only the last data_size bytes of a very long line can be kept.
+    if (size > hdr->data_size) {
+        buffptr += size - hdr->data_size;
+        pos = (dev->cb.bytes_added - hdr->data_size) & mask;
+        size = hdr->data_size;
+    } else {
+        pos = (dev->cb.bytes_added - size) & mask;
     }
+    first = min(size, hdr->data_size - pos);
 
-    *f_pos += bytes_to_read;
-    retval = bytes_to_read;
+    aesd_mmap_begin_update(hdr);
+    memcpy(dev->mmap_data + pos, buffptr, first);
+    memcpy(dev->mmap_data, buffptr + first, size - first);
+    aesd_mmap_sync_header(dev);
+    aesd_mmap_end_update(hdr);
+}
 
-out:
+/**
+ * Accounts for @param entry leaving the buffer of @param dev to make room.
+ * Must be called with dev->lock held.
+ */
+static void aesd_note_evicted(struct aesd_dev *dev, const struct aesd_buffer_entry *entry)
+{
+    dev->stats.evictions++;
+    trace_aesd_evict(dev->index, entry->seq, entry->size);
+}
+
+/**
+ * Traces the entry just added to the buffer of @param dev.
+ */
+static void aesd_note_committed(struct aesd_dev *dev)
+{
+    const struct aesd_buffer_entry *entry;
+
+    if (!trace_aesd_commit_enabled()) return;
+    entry = aesd_circular_buffer_get_entry(&dev->cb, aesd_circular_buffer_count(&dev->cb) - 1, NULL);
+    trace_aesd_commit(dev->index, entry->seq, entry->offset, entry->size);
+}
+
+/**
+ * Adds a completed line to the circular buffer, which takes ownership of
+ * @param buffptr. The evicted entry is freed once readers are done with it.
+ * Must be called with dev->lock held.
+ */
+static void aesd_commit_line(struct aesd_dev *dev, const char *buffptr, size_t size)
+{
+    struct aesd_buffer_entry new_entry, evicted = { .buffptr = NULL };
+    bool full = dev->cb.full;
+
+    if (full) evicted = dev->cb.entry[dev->cb.in_offs];
+    new_entry.buffptr = buffptr;
+    new_entry.size = size;
+    write_seqcount_begin(&dev->seq);
+    aesd_circular_buffer_add_entry(&dev->cb, &new_entry);
+    write_seqcount_end(&dev->seq);
+    aesd_mmap_append(dev, buffptr, size);
+    if (full) aesd_note_evicted(dev, &evicted);
+    aesd_note_committed(dev);
+    aesd_blob_free_deferred(evicted.buffptr);
+}
+
+/**
+ * Copies a completed line of at most dev->arena_size bytes into the arena and
+ * adds an entry for it, after evicting the oldest entries whose bytes it will
+ * overwrite. Both happen in one write section, so a reader whose copy raced
+ * with the overwrite sees the oldest byte held move past what it copied.
+ * Must be called with dev->lock held.
+ */
+static void aesd_arena_commit(struct aesd_dev *dev, const char *buf, size_t size)
+{
+    struct aesd_buffer_entry new_entry = { .buffptr = NULL, .size = size }, evicted;
+    size_t pos = dev->cb.bytes_added & (dev->arena_size - 1);
+    size_t first = min(size, dev->arena_size - pos);
+
+    write_seqcount_begin(&dev->seq);
+    while (aesd_circular_buffer_total_size(&dev->cb) + size > dev->arena_size) {
+        aesd_circular_buffer_remove_oldest(&dev->cb, &evicted);
+        aesd_note_evicted(dev, &evicted);
+    }
+    if (dev->cb.full) aesd_note_evicted(dev, &dev->cb.entry[dev->cb.in_offs]);
+    memcpy(dev->arena + pos, buf, first);
+    memcpy(dev->arena, buf + first, size - first);
+    aesd_circular_buffer_add_entry(&dev->cb, &new_entry);
+    write_seqcount_end(&dev->seq);
+    aesd_mmap_append(dev, buf, size);
+    aesd_note_committed(dev);
+}
+
+/**
+ * Takes over the line parked by a closed file as @param line, which is empty.
+ */
+static void aesd_adopt_parked(struct aesd_dev *dev, struct aesd_line *line)
+{
+    mutex_lock(&dev->lock);
+    if (dev->parked.buf) {
+        aesd_blob_free(line->buf);
+        *line = dev->parked;
+        memset(&dev->parked, 0, sizeof(dev->parked));
+    }
+    mutex_unlock(&dev->lock);
+}
+
+/**
+ * Makes room for at least @param need lines in the staging array of
+ * @param fdata, keeping the ones already staged.
+ */
+static int aesd_stage_reserve(struct aesd_file_data *fdata, size_t need)
+{
+    struct aesd_buffer_entry *staged;
+    size_t cap;
+
+    if (need <= fdata->staged_cap) return 0;
+    cap = max3(need, fdata->staged_cap * 2, (size_t)AESD_STAGED_MIN_CAP);
+    cap = min(cap, (size_t)AESD_STAGED_MAX_LINES);
+    staged = kvmalloc_array(cap, sizeof(*staged), GFP_KERNEL);
+    if (!staged) return -ENOMEM;
+    if (fdata->staged_cap) memcpy(staged, fdata->staged, fdata->staged_cap * sizeof(*staged));
+    kvfree(fdata->staged);
+    fdata->staged = staged;
+    fdata->staged_cap = cap;
+    return 0;
+}
+
+/**
+ * Links the lines staged by a write into the ring. This is all a write does
+ * under dev->lock, so concurrent writers only serialize on the linking.
+ */
+static void aesd_commit_staged(struct aesd_dev *dev, const struct aesd_buffer_entry *staged, size_t count)
+{
+    size_t i;
+
+    if (!count) return;
+    if (!mutex_trylock(&dev->lock)) {
+        u64 start = ktime_get_ns();
+
+        mutex_lock(&dev->lock);
+        dev->stats.lock_waits++;
+        dev->stats.lock_wait_ns += ktime_get_ns() - start;
+    }
+    for (i = 0; i < count; i++) {
+        if (dev->arena) aesd_arena_commit(dev, staged[i].buffptr, staged[i].size);
+        else aesd_commit_line(dev, staged[i].buffptr, staged[i].size);
+    }
     mutex_unlock(&dev->lock);
-    return retval;
 }
 
+/**
+ * Lines are assembled in the file's own accumulator and staging array under
+ * fdata->write_lock: the copy from userspace, the newline scan and the blob
+ * allocations all happen there. dev->lock is only taken to link the finished
+ * lines in, a batch of up to AESD_STAGED_MAX_LINES lines or
+ * AESD_STAGED_MAX_BYTES bytes at a time, so a write of many short lines
+ * neither pins unbounded memory nor holds dev->lock for long. The lines of
+ * one batch stay adjacent in the ring.
+ */
 ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
                 loff_t *f_pos)
 {
     ssize_t retval = -ENOMEM;
-    PDEBUG("write %zu bytes with offset %lld",count,*f_pos);
-    int res;
-    int bytes_scanned = 0;
-    struct aesd_dev *dev = filp ->private_data;
-    res = mutex_lock_interruptible(&dev->lock);
-    if (res) return -ERESTARTSYS;
-
-    char *new_data = (char *)kmalloc(count, GFP_KERNEL);
-    if (new_data == NULL) goto out;
-
-    memset(new_data, 0, count);
-    res = copy_from_user(new_data, buf, count);
-
-    while (bytes_scanned <= (count -1)){
-        temp_buffer = krealloc(temp_buffer, ++temp_buffer_size, GFP_KERNEL);
-        if (!temp_buffer){
-            retval = -ENOMEM;
-            goto out;
-        }
-        temp_buffer[temp_buffer_size-1] = new_data[bytes_scanned];
+    PDEBUG("write %zu bytes with offset %lld\n",count,*f_pos);
+    struct aesd_file_data *fdata = filp->private_data;
+    struct aesd_dev *dev = fdata->dev;
+    struct aesd_line *line = &fdata->partial;
+    size_t start = 0, scan, end, staged = 0, staged_bytes = 0, accepted = 0, pending;
+    char *acc, *nl;
 
-        if (new_data[bytes_scanned] == '\n'){
-            struct aesd_buffer_entry new_entry;
-            new_entry.buffptr = (char *)kmalloc(temp_buffer_size, GFP_KERNEL);
-            new_entry.size = temp_buffer_size;
-            memcpy(new_entry.buffptr, temp_buffer, temp_buffer_size);
+    if (count == 0) return 0;
+    if (mutex_lock_interruptible(&fdata->write_lock)) return -ERESTARTSYS;
 
-            if (dev->cb.full){
-                if (dev->cb.entry[dev->cb.in_offs].buffptr) kfree(dev->cb.entry[dev->cb.in_offs].buffptr);
+    /* continue a line left unterminated by a file that has since been closed */
+    if (!line->len && READ_ONCE(dev->parked.buf)) aesd_adopt_parked(dev, line);
+
+    pending = scan = line->len;
+    if (aesd_line_reserve(line, line->len + count)) goto out;
+    acc = line->buf;
+    if (copy_from_user(acc + line->len, buf, count)) {
+        retval = -EFAULT;
+        goto out;
+    }
+    end = line->len + count;
+
+    /* one pass over the new bytes, each completed line is staged as it is found */
+    while ((nl = scan < end ? memchr(acc + scan, '\n', end - scan) : NULL) != NULL) {
+        size_t size = nl - (acc + start) + 1, next = start + size;
+        struct aesd_buffer_entry *entry;
+
+        if (aesd_stage_reserve(fdata, staged + 1)) break;
+        entry = &fdata->staged[staged];
+        if (dev->arena) {
+            /* copied into the arena straight from the accumulator when committed */
+            if (size > dev->arena_size) {
+                retval = -EFBIG;
+                break;
             }
+            entry->buffptr = acc + start;
+        } else if (start == 0 && size * 2 >= line->cap) {
+            /*
+             * The line fills most of the accumulator: hand it over without
+             * copying. The rest of the write moves to a new accumulator
+             * first, since once in the ring another writer may evict and
+             * free the old one.
+             */
+            struct aesd_line rest = { 0 };
 
-            aesd_circular_buffer_add_entry(&dev->cb, &new_entry);
+            if (end > size) {
+                if (aesd_line_reserve(&rest, end - size)) break;
+                memcpy(rest.buf, acc + size, end - size);
+            }
+            entry->buffptr = acc;
+            *line = rest;
+            acc = line->buf;
+            end -= size;
+            next = 0;
+        } else {
+            char *copy = aesd_blob_alloc(size);
+            if (!copy) break;
+            memcpy(copy, acc + start, size);
+            entry->buffptr = copy;
+        }
+        entry->size = size;
+        staged++;
+        staged_bytes += size;
+        accepted += size;
+        start = scan = next;
 
-            temp_buffer = krealloc(temp_buffer, 0, GFP_KERNEL);
-            temp_buffer_size = 0;
+        if (staged == AESD_STAGED_MAX_LINES || staged_bytes >= AESD_STAGED_MAX_BYTES) {
+            aesd_commit_staged(dev, fdata->staged, staged);
+            staged = staged_bytes = 0;
         }
-        bytes_scanned++;
     }
 
-    retval = bytes_scanned;
-    *f_pos += bytes_scanned;
+    if (nl) {
+        /* a line could not be staged: commit the ones before it, drop the rest of this write */
+        if (!accepted) goto out;
+        end = start;
+        retval = accepted - pending;
+    } else {
+        /* the unterminated remainder is kept as this file's partial line */
+        retval = count;
+    }
+    aesd_commit_staged(dev, fdata->staged, staged);
+    if (acc) memmove(acc, acc + start, end - start);
+    line->len = end - start;
+    atomic_long_add((long)line->len - (long)pending, &dev->stats.partial_bytes);
+
+    *f_pos += retval;
 
-    
 out:
-    mutex_unlock(&dev->lock);
+    mutex_unlock(&fdata->write_lock);
+    if (accepted) wake_up_interruptible(&dev->readq);
     return retval;
 }
 
+/**
+ * Stream offset of the oldest byte still held, caller holds dev->lock
+ */
+static loff_t aesd_stream_base(struct aesd_dev *dev)
+{
+    return dev->cb.bytes_added - aesd_circular_buffer_total_size(&dev->cb);
+}
+
 loff_t aesd_llseek(struct file *filp, loff_t off, int whence)
 {
-    struct aesd_dev *dev = filp->private_data;
-    loff_t newpos;
-    loff_t cbuf_size;
+    struct aesd_file_data *fdata = filp->private_data;
+    struct aesd_dev *dev = fdata->dev;
+    loff_t cbuf_size, base;
 
-    uint8_t i;
-    struct aesd_buffer_entry *entry;
     if(mutex_lock_interruptible(&dev->lock)) return -ERESTARTSYS;
-    AESD_CIRCULAR_BUFFER_FOREACH(entry, &dev->cb, i) 
-    {
-        cbuf_size += entry->size;
-    }
+    cbuf_size = aesd_circular_buffer_total_size(&dev->cb);
+    base = aesd_stream_base(dev);
     mutex_unlock(&dev->lock);
 
-    return fixed_size_llseek(filp, off, whence, cbuf_size);
+    if (!fdata->follow) return fixed_size_llseek(filp, off, whence, cbuf_size);
+
+    // follow mode positions are stream offsets, moved up past evicted bytes.
+    switch (whence) {
+    case SEEK_SET:
+        break;
+    case SEEK_CUR:
+        off += filp->f_pos;
+        break;
+    case SEEK_END:
+        off += base + cbuf_size;
+        break;
+    default:
+        return -EINVAL;
+    }
+    if (off < 0 || off > base + cbuf_size) return -EINVAL;
+    filp->f_pos = max(off, base);
+    return filp->f_pos;
 }
 
-long aesd_unlocked_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
-    struct aesd_dev *dev = filp->private_data;
+static long aesd_ioctl_seekto(struct file *filp, struct aesd_dev *dev, unsigned long arg)
+{
+    struct aesd_file_data *fdata = filp->private_data;
     struct aesd_seekto seekto;
-    loff_t cbuf_size, new_fpos = 0;
-
-    if (_IOC_TYPE(cmd) != AESD_IOC_MAGIC) return -ENOTTY;
-    if (_IOC_NR(cmd) > AESDCHAR_IOC_MAXNR) return -ENOTTY;
-
-    // we only support one command, so if there is a different command, return error.
-    if (cmd != AESDCHAR_IOCSEEKTO) return -EINVAL;
+    loff_t base;
+    struct aesd_buffer_entry *entry;
+    size_t new_fpos = 0;
+    long retval = -EINVAL;
 
     if (copy_from_user(&seekto, (const void __user *)arg, sizeof(seekto)) != 0){
         return -EFAULT;
     }
 
-    if (seekto.write_cmd > AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED ) return -EINVAL;
+    if(mutex_lock_interruptible(&dev->lock)) return -ERESTARTSYS;
+    // write_cmd counts writes still held by the device, from the oldest.
+    entry = aesd_circular_buffer_get_entry(&dev->cb, seekto.write_cmd, &new_fpos);
+    if (entry && seekto.write_cmd_offset < entry->size) retval = 0;
+    base = aesd_stream_base(dev);
+    mutex_unlock(&dev->lock);
+
+    if (retval) return retval;
+    new_fpos += seekto.write_cmd_offset;
+    filp->f_pos = fdata->follow ? base + new_fpos : new_fpos;
+
+    return 0;
+}
 
-    uint8_t i;
+static long aesd_ioctl_seekseq(struct file *filp, struct aesd_dev *dev, unsigned long arg)
+{
+    struct aesd_file_data *fdata = filp->private_data;
+    struct aesd_seekseq seekseq;
     struct aesd_buffer_entry *entry;
+    size_t new_fpos;
+    loff_t base;
+
+    if (copy_from_user(&seekseq, (const void __user *)arg, sizeof(seekseq))) return -EFAULT;
+
     if(mutex_lock_interruptible(&dev->lock)) return -ERESTARTSYS;
-    AESD_CIRCULAR_BUFFER_FOREACH(entry, &dev->cb, i) 
-    {
-        cbuf_size += entry->size;
-        if (i < seekto.write_cmd) new_fpos += entry->size;
+    if (seekseq.seq > dev->cb.entries_added) {
+        mutex_unlock(&dev->lock);
+        return -EINVAL;
     }
+    entry = aesd_circular_buffer_find_entry_for_seq(&dev->cb, seekseq.seq, &new_fpos);
+    if (entry) {
+        seekseq.found_seq = entry->seq;
+    } else {
+        // resuming right after the newest write: wait at the end for the next one.
+        seekseq.found_seq = dev->cb.entries_added;
+        new_fpos = aesd_circular_buffer_total_size(&dev->cb);
+    }
+    base = aesd_stream_base(dev);
     mutex_unlock(&dev->lock);
 
-    if (new_fpos > cbuf_size) return -EINVAL;
-    new_fpos += seekto.write_cmd_offset;
-    filp->f_pos = new_fpos;
+    seekseq.flags = (seekseq.found_seq != seekseq.seq) ? AESD_SEEKSEQ_EVICTED : 0;
+    if (copy_to_user((void __user *)arg, &seekseq, sizeof(seekseq))) return -EFAULT;
+    filp->f_pos = fdata->follow ? base + new_fpos : new_fpos;
+    return 0;
+}
 
+static long aesd_ioctl_follow(struct file *filp, struct aesd_dev *dev, unsigned long arg)
+{
+    struct aesd_file_data *fdata = filp->private_data;
+    uint32_t follow;
+    loff_t base;
+
+    if (get_user(follow, (uint32_t __user *)arg)) return -EFAULT;
+
+    if(mutex_lock_interruptible(&dev->lock)) return -ERESTARTSYS;
+    base = aesd_stream_base(dev);
+    mutex_unlock(&dev->lock);
+
+    // carry the current position across the switch in either direction.
+    if (follow && !fdata->follow) filp->f_pos += base;
+    if (!follow && fdata->follow) filp->f_pos = max_t(loff_t, 0, filp->f_pos - base);
+    fdata->follow = follow != 0;
     return 0;
 }
 
+static void aesd_drop_entry(struct aesd_buffer_entry *entry)
+{
+    aesd_blob_free_deferred(entry->buffptr);
+    entry->buffptr = NULL;
+}
+
+static long aesd_ioctl_resize(struct file *filp, struct aesd_dev *dev, unsigned long arg)
+{
+    uint32_t capacity;
+    struct aesd_buffer_entry *storage = NULL;
+
+    // shrinking discards other writers' data: as much as a writer could evict.
+    if (!(filp->f_mode & FMODE_WRITE) && !capable(CAP_SYS_ADMIN)) return -EPERM;
+    if (get_user(capacity, (uint32_t __user *)arg)) return -EFAULT;
+    if (capacity == 0 || capacity > AESDCHAR_MAX_CAPACITY) return -EINVAL;
+
+    // allocate up front, nothing may sleep inside the seqcount write section.
+    if (capacity != AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) {
+        storage = kvcalloc(capacity, sizeof(*storage), GFP_KERNEL);
+        if (!storage) return -ENOMEM;
+    }
+
+    if(mutex_lock_interruptible(&dev->lock)) {
+        kvfree(storage);
+        return -ERESTARTSYS;
+    }
+    write_seqcount_begin(&dev->seq);
+    storage = aesd_circular_buffer_set_storage(&dev->cb, capacity, storage, aesd_drop_entry);
+    write_seqcount_end(&dev->seq);
+    if (dev->mmap_hdr) {
+        aesd_mmap_begin_update(dev->mmap_hdr);
+        aesd_mmap_sync_header(dev);
+        aesd_mmap_end_update(dev->mmap_hdr);
+    }
+    mutex_unlock(&dev->lock);
+
+    // lockless readers may still be walking the previous entry array.
+    if (storage) {
+        synchronize_srcu(&aesd_srcu);
+        kvfree(storage);
+    }
+    return 0;
+}
+
+/**
+ * Copies every record of a batch into its own blob before taking dev->lock,
+ * so the lock is held only to link the entries in.
+ */
+static long aesd_ioctl_append(struct aesd_dev *dev, unsigned long arg)
+{
+    struct aesd_append append;
+    struct aesd_record *records;
+    char **bufs;
+    uint32_t i;
+    u64 total = 0;
+    long retval = 0;
+
+    if (copy_from_user(&append, (const void __user *)arg, sizeof(append))) return -EFAULT;
+    if (append.count == 0 || append.count > AESDCHAR_APPEND_MAX) return -EINVAL;
+
+    records = kvmalloc_array(append.count, sizeof(*records), GFP_KERNEL);
+    bufs = kvcalloc(append.count, sizeof(*bufs), GFP_KERNEL);
+    if (!records || !bufs) {
+        retval = -ENOMEM;
+        goto out;
+    }
+    if (copy_from_user(records, u64_to_user_ptr(append.records), append.count * sizeof(*records))) {
+        retval = -EFAULT;
+        goto out;
+    }
+
+    for (i = 0; i < append.count; i++) {
+        total += records[i].len;
+        if (records[i].len == 0 || records[i].len > AESDCHAR_RECORD_MAX ||
+                total > AESDCHAR_APPEND_MAX_BYTES) {
+            retval = -EINVAL;
+            goto out;
+        }
+    }
+
+    for (i = 0; i < append.count; i++) {
+        if (dev->arena && records[i].len > dev->arena_size) {
+            retval = -EFBIG;
+            goto out;
+        }
+        bufs[i] = aesd_blob_alloc(records[i].len);
+        if (!bufs[i]) {
+            retval = -ENOMEM;
+            goto out;
+        }
+        if (copy_from_user(bufs[i], u64_to_user_ptr(records[i].data), records[i].len)) {
+            retval = -EFAULT;
+            goto out;
+        }
+    }
+
+    if (mutex_lock_interruptible(&dev->lock)) {
+        retval = -ERESTARTSYS;
+        goto out;
+    }
+    append.first_seq = dev->cb.entries_added;
+    for (i = 0; i < append.count; i++) {
+        if (dev->arena) {
+            // the arena takes a copy, bufs[i] is freed below.
+            aesd_arena_commit(dev, bufs[i], records[i].len);
+            continue;
+        }
+        aesd_commit_line(dev, bufs[i], records[i].len);
+        bufs[i] = NULL;
+    }
+    mutex_unlock(&dev->lock);
+    wake_up_interruptible(&dev->readq);
+
+    append.committed = append.count;
+    if (copy_to_user((void __user *)arg, &append, sizeof(append))) retval = -EFAULT;
+
+out:
+    if (bufs) {
+        for (i = 0; i < append.count; i++) aesd_blob_free(bufs[i]);
+    }
+    kvfree(bufs);
+    kvfree(records);
+    return retval;
+}
+
+long aesd_unlocked_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
+    struct aesd_dev *dev = ((struct aesd_file_data *)filp->private_data)->dev;
+
+    if (_IOC_TYPE(cmd) != AESD_IOC_MAGIC) return -ENOTTY;
+    if (_IOC_NR(cmd) > AESDCHAR_IOC_MAXNR) return -ENOTTY;
+
+    switch (cmd) {
+    case AESDCHAR_IOCSEEKTO:
+        return aesd_ioctl_seekto(filp, dev, arg);
+    case AESDCHAR_IOCRESIZE:
+        return aesd_ioctl_resize(filp, dev, arg);
+    case AESDCHAR_IOCFOLLOW:
+        return aesd_ioctl_follow(filp, dev, arg);
+    case AESDCHAR_IOCAPPEND:
+        return aesd_ioctl_append(dev, arg);
+    case AESDCHAR_IOCSEEKSEQ:
+        return aesd_ioctl_seekseq(filp, dev, arg);
+    default:
+        return -EINVAL;
+    }
+}
+
+/**
+ * Always writable. Readable when a read would not block: always outside
+ * follow mode, where a read at the end returns 0, and once a write lands past
+ * the file's position in follow mode.
+ */
+__poll_t aesd_poll(struct file *filp, poll_table *wait)
+{
+    struct aesd_file_data *fdata = filp->private_data;
+    struct aesd_dev *dev = fdata->dev;
+    __poll_t mask = EPOLLOUT | EPOLLWRNORM;
+
+    poll_wait(filp, &dev->readq, wait);
+    if (!fdata->follow || aesd_stream_head(dev) > READ_ONCE(filp->f_pos)) mask |= EPOLLIN | EPOLLRDNORM;
+    return mask;
+}
+
+/**
+ * Maps the header page and data ring read-only into the caller.
+ */
+int aesd_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct aesd_dev *dev = ((struct aesd_file_data *)filp->private_data)->dev;
+
+    if (!dev->mmap_hdr) return -ENODEV;
+    if (vma->vm_flags & VM_WRITE) return -EPERM;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+    vm_flags_clear(vma, VM_MAYWRITE);
+#else
+    vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+    return remap_vmalloc_range(vma, dev->mmap_hdr, vma->vm_pgoff);
+}
+
+/**
+ * Allocates the mmap view of @param dev, sized from aesd_mmap_size.
+ */
+static int aesd_mmap_init(struct aesd_dev *dev)
+{
+    size_t data_size;
+
+    if (!aesd_mmap_size) return 0;
+    data_size = roundup_pow_of_two(max_t(unsigned long, aesd_mmap_size, PAGE_SIZE));
+    dev->mmap_hdr = vmalloc_user(PAGE_SIZE + data_size);
+    if (!dev->mmap_hdr) return -ENOMEM;
+    dev->mmap_data = (char *)dev->mmap_hdr + PAGE_SIZE;
+    dev->mmap_hdr->data_offset = PAGE_SIZE;
+    dev->mmap_hdr->data_size = data_size;
+    return 0;
+}
+
+static int aesd_stats_show(struct seq_file *s, void *unused)
+{
+    struct aesd_dev *dev = s->private;
+    u64 reads = 0, read_bytes = 0;
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        struct aesd_read_stats *rs = per_cpu_ptr(dev->read_stats, cpu);
+        reads += READ_ONCE(rs->reads);
+        read_bytes += READ_ONCE(rs->read_bytes);
+    }
+
+    mutex_lock(&dev->lock);
+    seq_printf(s, "bytes_written %zu\n", dev->cb.bytes_added);
+    seq_printf(s, "entries_written %llu\n", (unsigned long long)dev->cb.entries_added);
+    seq_printf(s, "entries_held %u\n", aesd_circular_buffer_count(&dev->cb));
+    seq_printf(s, "bytes_held %zu\n", aesd_circular_buffer_total_size(&dev->cb));
+    seq_printf(s, "capacity %u\n", dev->cb.capacity);
+    seq_printf(s, "evictions %llu\n", dev->stats.evictions);
+    seq_printf(s, "lock_waits %llu\n", dev->stats.lock_waits);
+    seq_printf(s, "lock_wait_ns %llu\n", dev->stats.lock_wait_ns);
+    mutex_unlock(&dev->lock);
+    seq_printf(s, "partial_bytes %ld\n", atomic_long_read(&dev->stats.partial_bytes));
+    seq_printf(s, "reads %llu\n", reads);
+    seq_printf(s, "read_bytes %llu\n", read_bytes);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(aesd_stats);
+
+/**
+ * Adds aesdchar/<index>/stats for @param dev. debugfs failures are not fatal.
+ */
+static void aesd_debugfs_init(struct aesd_dev *dev)
+{
+    char name[16];
+
+    snprintf(name, sizeof(name), "%u", dev->index);
+    dev->debugfs = debugfs_create_dir(name, aesd_debugfs_root);
+    debugfs_create_file("stats", 0444, dev->debugfs, dev, &aesd_stats_fops);
+}
+
+/**
+ * Allocates the line storage of @param dev if aesd_arena_size selects an arena.
+ */
+static int aesd_arena_init(struct aesd_dev *dev)
+{
+    if (!aesd_arena_size) return 0;
+    dev->arena_size = roundup_pow_of_two(max_t(unsigned long, aesd_arena_size, PAGE_SIZE));
+    dev->arena = vmalloc(dev->arena_size);
+    return dev->arena ? 0 : -ENOMEM;
+}
+
 struct file_operations aesd_fops = {
     .owner =    THIS_MODULE,
-    .read =     aesd_read,
+    .read_iter = aesd_read_iter,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+    .splice_read = copy_splice_read,
+#else
+    .splice_read = generic_file_splice_read,
+#endif
     .write =    aesd_write,
     .open =     aesd_open,
     .release =  aesd_release,
     .llseek =   aesd_llseek,
     .unlocked_ioctl = aesd_unlocked_ioctl,
+    .poll =     aesd_poll,
+    .mmap =     aesd_mmap,
 };
 
-static int aesd_setup_cdev(struct aesd_dev *dev)
+static int aesd_setup_cdev(struct aesd_dev *dev, unsigned int index)
 {
-    int err, devno = MKDEV(aesd_major, aesd_minor);
+    int err, devno = MKDEV(aesd_major, aesd_minor + index);
 
     cdev_init(&dev->cdev, &aesd_fops);
     dev->cdev.owner = THIS_MODULE;
@@ -216,29 +1179,101 @@ static int aesd_setup_cdev(struct aesd_dev *dev)
     return err;
 }
 
+/**
+ * Frees everything a device holds. Its cdev has been removed or never added.
+ */
+static void aesd_dev_free(struct aesd_dev *dev)
+{
+    uint32_t index;
+    struct aesd_buffer_entry *entry;
+
+    debugfs_remove_recursive(dev->debugfs);
+    aesd_blob_free(dev->parked.buf);
+
+    AESD_CIRCULAR_BUFFER_FOREACH(entry, &dev->cb, index){
+        if (entry->buffptr) {
+            aesd_blob_free(entry->buffptr);
+            entry->buffptr = NULL;
+        }
+    }
+    aesd_circular_buffer_free(&dev->cb);
+    vfree(dev->arena);
+    vfree(dev->mmap_hdr);
+    free_percpu(dev->read_stats);
+    mutex_destroy(&dev->lock);
+}
+
+/**
+ * Sets up minor aesd_minor + @param index with its own buffer and lock.
+ */
+static int aesd_dev_init(struct aesd_dev *dev, unsigned int index)
+{
+    int result;
+
+    dev->index = index;
+    mutex_init(&dev->lock);
+    seqcount_mutex_init(&dev->seq, &dev->lock);
+    init_waitqueue_head(&dev->readq);
+    result = aesd_circular_buffer_init_capacity(&dev->cb, aesd_capacity);
+    if (result) {
+        printk(KERN_WARNING "Invalid aesd_capacity %u\n", aesd_capacity);
+        mutex_destroy(&dev->lock);
+        return result;
+    }
 
+    dev->read_stats = alloc_percpu(struct aesd_read_stats);
+    if (!dev->read_stats) result = -ENOMEM;
+    if (!result) result = aesd_arena_init(dev);
+    if (!result) result = aesd_mmap_init(dev);
+    if (!result) result = aesd_setup_cdev(dev, index);
+    if (result) aesd_dev_free(dev);
+    else aesd_debugfs_init(dev);
+    return result;
+}
 
 int aesd_init_module(void)
 {
     dev_t dev = 0;
+    unsigned int i;
     int result;
-    result = alloc_chrdev_region(&dev, aesd_minor, 1,
+
+    if (aesd_nr_devs == 0 || aesd_nr_devs > AESD_MAX_DEVICES) {
+        printk(KERN_WARNING "Invalid aesd_nr_devs %u\n", aesd_nr_devs);
+        return -EINVAL;
+    }
+    result = alloc_chrdev_region(&dev, aesd_minor, aesd_nr_devs,
             "aesdchar");
     aesd_major = MAJOR(dev);
     if (result < 0) {
         printk(KERN_WARNING "Can't get major %d\n", aesd_major);
         return result;
     }
-    memset(&aesd_device,0,sizeof(struct aesd_dev));
 
-    mutex_init(&aesd_device.lock);
-    aesd_circular_buffer_init(&aesd_device.cb);
-    temp_buffer = (char *)kmalloc(TEMP_BUFFER_SIZE, GFP_KERNEL);
+    aesd_devices = kcalloc(aesd_nr_devs, sizeof(*aesd_devices), GFP_KERNEL);
+    if (!aesd_devices) {
+        unregister_chrdev_region(dev, aesd_nr_devs);
+        return -ENOMEM;
+    }
 
-    result = aesd_setup_cdev(&aesd_device);
+    aesd_debugfs_root = debugfs_create_dir("aesdchar", NULL);
+    result = aesd_blob_cache_init();
+    for (i = 0; !result && i < aesd_nr_devs; i++) {
+        result = aesd_dev_init(&aesd_devices[i], i);
+        if (result) {
+            // the failed device cleaned up after itself, undo the ones before it.
+            while (i-- > 0) {
+                cdev_del(&aesd_devices[i].cdev);
+                aesd_dev_free(&aesd_devices[i]);
+            }
+            break;
+        }
+    }
 
     if( result ) {
-        unregister_chrdev_region(dev, 1);
+        debugfs_remove_recursive(aesd_debugfs_root);
+        aesd_blob_cache_destroy();
+        kfree(aesd_devices);
+        unregister_chrdev_region(dev, aesd_nr_devs);
     }
     return result;
 
@@ -247,24 +1282,19 @@ int aesd_init_module(void)
 void aesd_cleanup_module(void)
 {
     dev_t devno = MKDEV(aesd_major, aesd_minor);
+    unsigned int i;
 
-    cdev_del(&aesd_device.cdev);
-
-    uint8_t index;
-    struct aesd_buffer_entry *entry;
-
-    if (temp_buffer) kfree(temp_buffer);
-
-    AESD_CIRCULAR_BUFFER_FOREACH(entry, &aesd_device.cb, index){
-        if (entry->buffptr) {
-            kfree (entry->buffptr);
-            entry->buffptr = NULL;
-        }
+    for (i = 0; i < aesd_nr_devs; i++) {
+        cdev_del(&aesd_devices[i].cdev);
+        aesd_dev_free(&aesd_devices[i]);
     }
+    debugfs_remove_recursive(aesd_debugfs_root);
+    // let pending deferred frees run before the module text goes away.
+    srcu_barrier(&aesd_srcu);
+    aesd_blob_cache_destroy();
+    kfree(aesd_devices);
 
-    mutex_destroy(&aesd_device.lock);
-
-    unregister_chrdev_region(devno, 1);
+    unregister_chrdev_region(devno, aesd_nr_devs);
 }
 
 
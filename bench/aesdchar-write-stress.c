@@ -0,0 +1,266 @@
+/**
+ * @file aesdchar-write-stress.c
+ * @brief Write stress for the loaded aesdchar driver
+ *
+ * Writes a stream of newline terminated lines to the device and reports the
+ * write latency distribution along with how many blobs the driver allocated
+ * from its size-class caches and from kmalloc. Load the module once with
+ * aesd_pool=0 and once with the default to compare the two allocators.
+ * With -r it then reads the whole history back that many times and reports
+ * the read throughput, e.g. to compare per-line blobs with aesd_arena_size.
+ * With -t it finally splits the same number of lines across 1, 2, 4... up to
+ * that many writer threads, each with its own open file, and reports the
+ * write throughput at each step to show how concurrent writers scale.
+ *
+ * Usage: aesdchar-write-stress [-d device] [-n lines] [-s max line size] [-r full reads]
+ *            [-t max writer threads]
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PARAM_DIR "/sys/module/aesdchar/parameters/"
+
+static long read_counter(const char *name)
+{
+    char path[128];
+    long value = -1;
+    FILE *f;
+
+    snprintf(path, sizeof(path), PARAM_DIR "%s", name);
+    f = fopen(path, "r");
+    if (f == NULL) return -1;
+    if (fscanf(f, "%ld", &value) != 1) value = -1;
+    fclose(f);
+    return value;
+}
+
+static int read_flag(const char *name)
+{
+    char path[128], value = '?';
+    FILE *f;
+
+    snprintf(path, sizeof(path), PARAM_DIR "%s", name);
+    f = fopen(path, "r");
+    if (f == NULL) return '?';
+    if (fscanf(f, " %c", &value) != 1) value = '?';
+    fclose(f);
+    return value;
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+ * Reads @param device from the start to the end @param passes times.
+ */
+static void read_back(const char *device, long passes)
+{
+    size_t cap = 64 << 20;
+    char *buf = malloc(cap);
+    long calls = 0, bytes = 0;
+    double start, elapsed;
+    ssize_t n;
+    int fd;
+
+    fd = open(device, O_RDONLY);
+    if (fd < 0 || buf == NULL) {
+        fprintf(stderr, "read back %s: %s\n", device, strerror(errno));
+        exit(1);
+    }
+    start = now_ns();
+    for (long i = 0; i < passes; i++) {
+        lseek(fd, 0, SEEK_SET);
+        while ((n = read(fd, buf, cap)) > 0) {
+            bytes += n;
+            calls++;
+        }
+        if (n < 0) {
+            fprintf(stderr, "read: %s\n", strerror(errno));
+            exit(1);
+        }
+    }
+    elapsed = now_ns() - start;
+    close(fd);
+    free(buf);
+
+    printf("full read: %ld bytes, %.1f us and %.1f read calls per pass, %.1f MB/s\n",
+            bytes / passes, elapsed / passes / 1e3, (double)calls / passes, bytes * 1e3 / elapsed);
+}
+
+struct writer {
+    pthread_t thread;
+    const char *device;
+    long lines;
+    long max_size;
+    unsigned int seed;
+    long bytes;
+    int error;
+};
+
+static void *writer_func(void *arg)
+{
+    struct writer *w = arg;
+    char *line = malloc(w->max_size);
+    int fd = open(w->device, O_WRONLY);
+
+    if (fd < 0 || line == NULL) {
+        w->error = fd < 0 ? errno : ENOMEM;
+        if (fd >= 0) close(fd);
+        free(line);
+        return NULL;
+    }
+    memset(line, 'x', w->max_size);
+    for (long i = 0; i < w->lines; i++) {
+        size_t size = 2 + rand_r(&w->seed) % (w->max_size - 1);
+
+        line[size - 1] = '\n';
+        if (write(fd, line, size) != (ssize_t)size) {
+            w->error = errno;
+            break;
+        }
+        line[size - 1] = 'x';
+        w->bytes += size;
+    }
+    close(fd);
+    free(line);
+    return NULL;
+}
+
+/**
+ * Writes @param lines lines split across @param num_writers threads.
+ */
+static void scale_run(const char *device, int num_writers, long lines, long max_size)
+{
+    struct writer *writers = calloc(num_writers, sizeof(*writers));
+    long bytes = 0;
+    double start, elapsed;
+
+    if (writers == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    start = now_ns();
+    for (int i = 0; i < num_writers; i++) {
+        writers[i].device = device;
+        writers[i].lines = lines / num_writers;
+        writers[i].max_size = max_size;
+        writers[i].seed = i + 1;
+        pthread_create(&writers[i].thread, NULL, writer_func, &writers[i]);
+    }
+    for (int i = 0; i < num_writers; i++) {
+        pthread_join(writers[i].thread, NULL);
+        if (writers[i].error) {
+            fprintf(stderr, "writer %d: %s\n", i, strerror(writers[i].error));
+            exit(1);
+        }
+        bytes += writers[i].bytes;
+    }
+    elapsed = now_ns() - start;
+
+    printf("%8d %14.0f %10.1f\n", num_writers, lines / num_writers * num_writers * 1e9 / elapsed,
+            bytes * 1e3 / elapsed);
+    free(writers);
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char **argv)
+{
+    const char *device = "/dev/aesdchar";
+    long lines = 100000, max_size = 512, passes = 0;
+    int max_writers = 0;
+    long pool_before, kmalloc_before;
+    double *latency, start, total = 0;
+    char *line;
+    int opt, fd;
+
+    while ((opt = getopt(argc, argv, "d:n:s:r:t:")) != -1) {
+        switch (opt) {
+        case 'd': device = optarg; break;
+        case 'n': lines = strtol(optarg, NULL, 10); break;
+        case 's': max_size = strtol(optarg, NULL, 10); break;
+        case 'r': passes = strtol(optarg, NULL, 10); break;
+        case 't': max_writers = atoi(optarg); break;
+        default:
+            fprintf(stderr, "Usage: %s [-d device] [-n lines] [-s max line size] [-r full reads]"
+                    " [-t max writer threads]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (lines <= 0 || max_size < 2) {
+        fprintf(stderr, "lines must be positive and max line size at least 2\n");
+        return 1;
+    }
+
+    fd = open(device, O_WRONLY);
+    if (fd < 0) {
+        fprintf(stderr, "open %s: %s\n", device, strerror(errno));
+        return 1;
+    }
+    latency = malloc(lines * sizeof(double));
+    line = malloc(max_size);
+    if (latency == NULL || line == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    memset(line, 'x', max_size);
+
+    srand(1);
+    pool_before = read_counter("pool_allocs");
+    kmalloc_before = read_counter("kmalloc_allocs");
+    for (long i = 0; i < lines; i++) {
+        size_t size = 2 + rand() % (max_size - 1);
+
+        line[size - 1] = '\n';
+        start = now_ns();
+        if (write(fd, line, size) != (ssize_t)size) {
+            fprintf(stderr, "write: %s\n", strerror(errno));
+            return 1;
+        }
+        latency[i] = now_ns() - start;
+        line[size - 1] = 'x';
+        total += latency[i];
+    }
+    close(fd);
+
+    qsort(latency, lines, sizeof(double), cmp_double);
+    printf("aesd_pool=%c aesd_arena_size=%ld lines=%ld max_size=%ld\n", read_flag("aesd_pool"),
+            read_counter("aesd_arena_size"), lines, max_size);
+    printf("write ns: mean %.0f p50 %.0f p99 %.0f max %.0f\n", total / lines,
+            latency[lines / 2], latency[lines * 99 / 100], latency[lines - 1]);
+    if (pool_before >= 0 && kmalloc_before >= 0) {
+        printf("allocations: pool %ld kmalloc %ld\n",
+                read_counter("pool_allocs") - pool_before,
+                read_counter("kmalloc_allocs") - kmalloc_before);
+    } else {
+        printf("allocations: counters unavailable under " PARAM_DIR "\n");
+    }
+    if (passes > 0) read_back(device, passes);
+    if (max_writers > 0) {
+        printf("%8s %14s %10s\n", "writers", "lines/s", "MB/s");
+        for (int n = 1; ; n *= 2) {
+            if (n > max_writers) n = max_writers;
+            scale_run(device, n, lines, max_size);
+            if (n == max_writers) break;
+        }
+    }
+
+    free(line);
+    free(latency);
+    return 0;
+}
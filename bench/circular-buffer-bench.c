@@ -0,0 +1,258 @@
+/**
+ * @file circular-buffer-bench.c
+ * @brief Userspace microbenchmark for aesd-circular-buffer.c
+ *
+ * Times aesd_circular_buffer_add_entry() and
+ * aesd_circular_buffer_find_entry_offset_for_fpos(), the latter against the
+ * linear walk it replaced, for a range of capacities, entry size
+ * distributions and fill levels. Where perf_event_open() is allowed, lookups
+ * also report hardware cache misses per operation; otherwise that column
+ * shows "-" (see /proc/sys/kernel/perf_event_paranoid).
+ *
+ * Usage: circular-buffer-bench [-c capacity] [-l lookups]
+ */
+
+#include <linux/perf_event.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include "../aesd-char-driver/aesd-circular-buffer.h"
+
+#define LOOKUPS 200000
+#define ADDS 1000000
+
+static const char payload[4096];
+
+struct size_dist {
+    const char *name;
+    size_t (*next)(void);
+};
+
+static size_t size_fixed(void)
+{
+    return 64;
+}
+
+static size_t size_uniform(void)
+{
+    return 1 + rand() % 256;
+}
+
+// mostly short lines with the occasional page sized write.
+static size_t size_bimodal(void)
+{
+    return (rand() % 10) ? 16 : sizeof(payload);
+}
+
+static const struct size_dist dists[] = {
+    { "fixed64", size_fixed },
+    { "uniform", size_uniform },
+    { "bimodal", size_bimodal },
+};
+
+struct fill_level {
+    const char *name;
+    // entries added, in percent of the capacity.
+    unsigned int percent;
+};
+
+static const struct fill_level fills[] = {
+    { "25%", 25 },
+    { "50%", 50 },
+    { "full", 100 },
+    { "wrapped", 150 },
+};
+
+/**
+ * The linear lookup used before entries carried their stream offset.
+ */
+static struct aesd_buffer_entry *linear_find(struct aesd_circular_buffer *buffer,
+            size_t char_offset, size_t *entry_offset_byte_rtn)
+{
+    uint32_t count = aesd_circular_buffer_count(buffer);
+    for (uint32_t n = 0; n < count; n++) {
+        struct aesd_buffer_entry *entry = &buffer->entry[aesd_circular_buffer_slot(buffer, n)];
+        if (char_offset < entry->size) {
+            *entry_offset_byte_rtn = char_offset;
+            return entry;
+        }
+        char_offset -= entry->size;
+    }
+    return NULL;
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+ * @return a disabled counter of this thread's hardware cache misses in user
+ * mode, or -1 if the kernel or the CPU does not provide one.
+ */
+static int perf_open(void)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void perf_start(int fd)
+{
+    if (fd == -1) return;
+    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+}
+
+/**
+ * @return the misses counted since perf_start(), or -1 if unavailable.
+ */
+static long long perf_stop(int fd)
+{
+    long long count;
+
+    if (fd == -1) return -1;
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(fd, &count, sizeof(count)) != sizeof(count)) return -1;
+    return count;
+}
+
+/**
+ * Empties @param buffer without freeing its storage, so the add loop does not
+ * time the allocator.
+ */
+static void reset(struct aesd_circular_buffer *buffer)
+{
+    buffer->in_offs = buffer->out_offs = 0;
+    buffer->full = false;
+}
+
+static void fill(struct aesd_circular_buffer *buffer, uint32_t entries, const struct size_dist *dist)
+{
+    for (uint32_t i = 0; i < entries; i++) {
+        struct aesd_buffer_entry entry = { .buffptr = payload, .size = dist->next() };
+        aesd_circular_buffer_add_entry(buffer, &entry);
+    }
+}
+
+static void bench(uint32_t capacity, const struct size_dist *dist, const struct fill_level *level,
+            int max_lookups, int perf_fd)
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry *entries;
+    uint32_t count = (uint64_t)capacity * level->percent / 100;
+    size_t offset, total, sink = 0;
+    size_t *positions;
+    double start, add_ns, find_ns, linear_ns;
+    long long misses;
+    char miss_str[16] = "-";
+    int lookups = max_lookups;
+    long adds = 0;
+
+    if (count == 0) count = 1;
+    if (aesd_circular_buffer_init_capacity(&buffer, capacity) != 0) {
+        fprintf(stderr, "capacity %u: init failed\n", capacity);
+        return;
+    }
+
+    // draw the sizes up front so rand() stays out of the timed add loop.
+    entries = malloc(count * sizeof(*entries));
+    positions = malloc(max_lookups * sizeof(size_t));
+    if (entries == NULL || positions == NULL) {
+        free(entries);
+        free(positions);
+        aesd_circular_buffer_free(&buffer);
+        return;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        entries[i].buffptr = payload;
+        entries[i].size = dist->next();
+    }
+    start = now_ns();
+    while (adds < ADDS) {
+        reset(&buffer);
+        for (uint32_t i = 0; i < count; i++) aesd_circular_buffer_add_entry(&buffer, &entries[i]);
+        adds += count;
+    }
+    add_ns = (now_ns() - start) / adds;
+    free(entries);
+
+    // the lookups run on a freshly filled buffer.
+    reset(&buffer);
+    fill(&buffer, count, dist);
+    total = aesd_circular_buffer_total_size(&buffer);
+
+    // keep the linear runs short for large capacities.
+    if ((size_t)lookups * capacity > 400000000ul) lookups = 400000000ul / capacity;
+    for (int i = 0; i < max_lookups; i++) positions[i] = (size_t)rand() % total;
+
+    perf_start(perf_fd);
+    start = now_ns();
+    for (int i = 0; i < max_lookups; i++) {
+        sink += (size_t)aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, positions[i], &offset) + offset;
+    }
+    find_ns = (now_ns() - start) / max_lookups;
+    misses = perf_stop(perf_fd);
+
+    start = now_ns();
+    for (int i = 0; i < lookups; i++) {
+        sink += (size_t)linear_find(&buffer, positions[i], &offset) + offset;
+    }
+    linear_ns = (now_ns() - start) / lookups;
+
+    if (misses >= 0) snprintf(miss_str, sizeof(miss_str), "%.3f", (double)misses / max_lookups);
+    printf("%9u %8s %8s %10.1f %10.1f %12s %12.1f   (%zu)\n", capacity, dist->name, level->name,
+            add_ns, find_ns, miss_str, linear_ns, sink & 1);
+
+    free(positions);
+    aesd_circular_buffer_free(&buffer);
+}
+
+int main(int argc, char **argv)
+{
+    static const uint32_t capacities[] = { 10, 64, 256, 1024, 4096, 16384, 65536 };
+    uint32_t only = 0;
+    int lookups = LOOKUPS, opt, perf_fd;
+
+    while ((opt = getopt(argc, argv, "c:l:")) != -1) {
+        switch (opt) {
+        case 'c': only = strtoul(optarg, NULL, 10); break;
+        case 'l': lookups = atoi(optarg); break;
+        default:
+            fprintf(stderr, "Usage: %s [-c capacity] [-l lookups]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (lookups < 1) lookups = 1;
+
+    perf_fd = perf_open();
+    if (perf_fd == -1) printf("cache miss counter unavailable, misses not reported\n");
+
+    srand(1);
+    printf("%9s %8s %8s %10s %10s %12s %12s\n", "capacity", "sizes", "fill", "add ns/op",
+            "find ns/op", "find miss/op", "linear ns/op");
+    for (size_t c = 0; c < sizeof(capacities) / sizeof(capacities[0]); c++) {
+        uint32_t capacity = only ? only : capacities[c];
+        for (size_t d = 0; d < sizeof(dists) / sizeof(dists[0]); d++) {
+            for (size_t f = 0; f < sizeof(fills) / sizeof(fills[0]); f++) {
+                bench(capacity, &dists[d], &fills[f], lookups, perf_fd);
+            }
+        }
+        if (only) break;
+    }
+    if (perf_fd != -1) close(perf_fd);
+    return 0;
+}
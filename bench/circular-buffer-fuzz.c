@@ -0,0 +1,277 @@
+/**
+ * @file circular-buffer-fuzz.c
+ * @brief Randomized differential test of aesd-circular-buffer.c
+ *
+ * Drives the circular buffer and a trivial reference model, a plain array of
+ * the retained entries in insertion order, with the same random sequence of
+ * adds, removals, lookups and resizes, and stops at the first result where they
+ * disagree. Run it after any change to the ring's layout.
+ *
+ * Usage: circular-buffer-fuzz [-s seed] [-n operations]
+ * A failure prints the seed and operation number so it can be replayed.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../aesd-char-driver/aesd-circular-buffer.h"
+
+#define MAX_FUZZ_CAPACITY 512
+
+struct ref_entry {
+    const char *buffptr;
+    size_t size;
+    uint64_t seq;
+};
+
+/**
+ * The reference model: entries[0] is the oldest retained entry.
+ */
+struct ref_model {
+    struct ref_entry *entries;
+    uint32_t count;
+    uint32_t capacity;
+    uint64_t entries_added;
+};
+
+static const char payload[256];
+static unsigned int seed = 1;
+static long op;
+
+// entries passed to the drop callback by the last resize, oldest first.
+static uint64_t dropped[AESDCHAR_MAX_CAPACITY];
+static uint32_t num_dropped;
+
+static void drop_entry(struct aesd_buffer_entry *entry)
+{
+    dropped[num_dropped++] = entry->seq;
+}
+
+static void fail(const char *what, unsigned long long expected, unsigned long long actual)
+{
+    fprintf(stderr, "seed %u operation %ld: %s: expected %llu, got %llu\n",
+            seed, op, what, expected, actual);
+    exit(1);
+}
+
+static void check(const char *what, unsigned long long expected, unsigned long long actual)
+{
+    if (expected != actual) fail(what, expected, actual);
+}
+
+static size_t ref_total_size(const struct ref_model *ref)
+{
+    size_t total = 0;
+    for (uint32_t i = 0; i < ref->count; i++) total += ref->entries[i].size;
+    return total;
+}
+
+static void ref_add(struct ref_model *ref, const struct ref_entry *entry)
+{
+    if (ref->count == ref->capacity) {
+        memmove(ref->entries, ref->entries + 1, (ref->count - 1) * sizeof(*ref->entries));
+        ref->count--;
+    }
+    ref->entries[ref->count] = *entry;
+    ref->entries[ref->count].seq = ref->entries_added++;
+    ref->count++;
+}
+
+/**
+ * Entry sizes: mostly small lines, some empty writes and some large ones.
+ */
+static size_t random_size(void)
+{
+    int r = rand() % 100;
+    if (r < 5) return 0;
+    if (r < 90) return 1 + rand() % 80;
+    return 1 + rand() % 100000;
+}
+
+static void check_state(struct aesd_circular_buffer *buffer, const struct ref_model *ref)
+{
+    check("count", ref->count, aesd_circular_buffer_count(buffer));
+    check("capacity", ref->capacity, buffer->capacity);
+    check("total size", ref_total_size(ref), aesd_circular_buffer_total_size(buffer));
+    check("entries added", ref->entries_added, buffer->entries_added);
+}
+
+static void fuzz_add(struct aesd_circular_buffer *buffer, struct ref_model *ref)
+{
+    struct ref_entry ref_entry = { .buffptr = payload + rand() % sizeof(payload), .size = random_size() };
+    struct aesd_buffer_entry entry = { .buffptr = ref_entry.buffptr, .size = ref_entry.size };
+
+    aesd_circular_buffer_add_entry(buffer, &entry);
+    ref_add(ref, &ref_entry);
+}
+
+static void fuzz_find_fpos(struct aesd_circular_buffer *buffer, const struct ref_model *ref)
+{
+    size_t total = ref_total_size(ref), offset = 0, expected_offset = 0;
+    size_t pos = (size_t)rand() % (total + 8);
+    const struct ref_entry *expected = NULL;
+    struct aesd_buffer_entry *entry;
+
+    // walk the model linearly, skipping empty entries.
+    size_t remaining = pos;
+    for (uint32_t i = 0; i < ref->count; i++) {
+        if (remaining < ref->entries[i].size) {
+            expected = &ref->entries[i];
+            expected_offset = remaining;
+            break;
+        }
+        remaining -= ref->entries[i].size;
+    }
+
+    entry = aesd_circular_buffer_find_entry_offset_for_fpos(buffer, pos, &offset);
+    if (expected == NULL) {
+        if (entry != NULL) fail("find past the end returned seq", ~0ull, entry->seq);
+        return;
+    }
+    if (entry == NULL) fail("find returned NULL for seq", expected->seq, ~0ull);
+    check("find seq", expected->seq, entry->seq);
+    check("find offset in entry", expected_offset, offset);
+    check("find buffptr", (uintptr_t)expected->buffptr, (uintptr_t)entry->buffptr);
+    check("find size", expected->size, entry->size);
+}
+
+static void fuzz_get_entry(struct aesd_circular_buffer *buffer, const struct ref_model *ref)
+{
+    uint32_t n = rand() % (ref->count + 3);
+    size_t offset = 0, expected_offset = 0;
+    struct aesd_buffer_entry *entry = aesd_circular_buffer_get_entry(buffer, n, &offset);
+
+    if (n >= ref->count) {
+        if (entry != NULL) fail("get_entry past the end returned seq", ~0ull, entry->seq);
+        return;
+    }
+    for (uint32_t i = 0; i < n; i++) expected_offset += ref->entries[i].size;
+    if (entry == NULL) fail("get_entry returned NULL for seq", ref->entries[n].seq, ~0ull);
+    check("get_entry seq", ref->entries[n].seq, entry->seq);
+    check("get_entry char offset", expected_offset, offset);
+}
+
+static void fuzz_find_seq(struct aesd_circular_buffer *buffer, const struct ref_model *ref)
+{
+    uint64_t first = ref->entries_added - ref->count;
+    uint64_t low = first > 3 ? first - 3 : 0;
+    uint64_t seq = low + (uint64_t)rand() % (ref->entries_added + 3 - low);
+    size_t offset = 0, expected_offset = 0;
+    const struct ref_entry *expected = NULL;
+    struct aesd_buffer_entry *entry;
+
+    for (uint32_t i = 0; i < ref->count; i++) {
+        if (ref->entries[i].seq >= seq) {
+            expected = &ref->entries[i];
+            break;
+        }
+        expected_offset += ref->entries[i].size;
+    }
+
+    entry = aesd_circular_buffer_find_entry_for_seq(buffer, seq, &offset);
+    if (expected == NULL) {
+        if (entry != NULL) fail("find_entry_for_seq past the end returned seq", ~0ull, entry->seq);
+        return;
+    }
+    if (entry == NULL) fail("find_entry_for_seq returned NULL for seq", expected->seq, ~0ull);
+    check("find_entry_for_seq seq", expected->seq, entry->seq);
+    check("find_entry_for_seq char offset", expected_offset, offset);
+}
+
+static void fuzz_remove_oldest(struct aesd_circular_buffer *buffer, struct ref_model *ref)
+{
+    struct aesd_buffer_entry removed;
+    bool expected = ref->count > 0;
+
+    check("remove_oldest result", expected, aesd_circular_buffer_remove_oldest(buffer, &removed));
+    if (!expected) return;
+    check("removed seq", ref->entries[0].seq, removed.seq);
+    check("removed buffptr", (uintptr_t)ref->entries[0].buffptr, (uintptr_t)removed.buffptr);
+    memmove(ref->entries, ref->entries + 1, (ref->count - 1) * sizeof(*ref->entries));
+    ref->count--;
+}
+
+static void fuzz_resize(struct aesd_circular_buffer *buffer, struct ref_model *ref)
+{
+    int r = rand() % 10;
+    uint32_t capacity;
+    int expected = 0;
+
+    if (r == 0) capacity = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    else if (r == 1) capacity = ref->capacity;
+    else if (r == 2) capacity = (rand() % 2) ? 0 : AESDCHAR_MAX_CAPACITY + 1;
+    else capacity = 1 + rand() % MAX_FUZZ_CAPACITY;
+    if (capacity == 0 || capacity > AESDCHAR_MAX_CAPACITY) expected = -EINVAL;
+
+    num_dropped = 0;
+    check("resize result", expected, aesd_circular_buffer_resize(buffer, capacity, drop_entry));
+    if (expected != 0) {
+        check("entries dropped by a failed resize", 0, num_dropped);
+        return;
+    }
+
+    uint32_t drop = ref->count > capacity ? ref->count - capacity : 0;
+    check("entries dropped", drop, num_dropped);
+    for (uint32_t i = 0; i < drop; i++) check("dropped seq", ref->entries[i].seq, dropped[i]);
+    memmove(ref->entries, ref->entries + drop, (ref->count - drop) * sizeof(*ref->entries));
+    ref->count -= drop;
+    ref->capacity = capacity;
+}
+
+static void fuzz_reset(struct aesd_circular_buffer *buffer, struct ref_model *ref)
+{
+    uint32_t capacity = (rand() % 2) ? AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED : 1 + rand() % MAX_FUZZ_CAPACITY;
+
+    aesd_circular_buffer_free(buffer);
+    check("init_capacity result", 0, aesd_circular_buffer_init_capacity(buffer, capacity));
+    ref->count = 0;
+    ref->capacity = capacity;
+    ref->entries_added = 0;
+}
+
+int main(int argc, char **argv)
+{
+    struct aesd_circular_buffer buffer;
+    struct ref_model ref = { .capacity = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED };
+    long ops = 1000000;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:n:")) != -1) {
+        switch (opt) {
+        case 's': seed = strtoul(optarg, NULL, 10); break;
+        case 'n': ops = strtol(optarg, NULL, 10); break;
+        default:
+            fprintf(stderr, "Usage: %s [-s seed] [-n operations]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    ref.entries = malloc(AESDCHAR_MAX_CAPACITY * sizeof(*ref.entries));
+    if (ref.entries == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    srand(seed);
+    aesd_circular_buffer_init(&buffer);
+
+    for (op = 0; op < ops; op++) {
+        int r = rand() % 1000;
+
+        // adds dominate so the ring wraps many times between resizes.
+        if (r < 550) fuzz_add(&buffer, &ref);
+        else if (r < 750) fuzz_find_fpos(&buffer, &ref);
+        else if (r < 850) fuzz_get_entry(&buffer, &ref);
+        else if (r < 930) fuzz_find_seq(&buffer, &ref);
+        else if (r < 950) fuzz_remove_oldest(&buffer, &ref);
+        else if (r < 998) fuzz_resize(&buffer, &ref);
+        else fuzz_reset(&buffer, &ref);
+        check_state(&buffer, &ref);
+    }
+
+    printf("seed %u: %ld operations, no differences\n", seed, ops);
+    aesd_circular_buffer_free(&buffer);
+    free(ref.entries);
+    return 0;
+}
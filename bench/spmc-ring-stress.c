@@ -0,0 +1,243 @@
+/**
+ * @file spmc-ring-stress.c
+ * @brief Multi-threaded stress test for aesd-spmc-ring.c
+ *
+ * One producer thread pushes entries as fast as it can while 1, 2, 4... reader
+ * threads, up to -r, look up random entries still held by the ring. Every
+ * entry read is checked against the values the producer derived from its
+ * sequence number, so a torn copy shows up as an error. The same load is then
+ * run against aesd_circular_buffer behind a mutex, the way the driver used
+ * it before its readers went lockless, to show how reads scale without the
+ * lock. A last pass has each reader follow the stream with a cursor and
+ * checks no entry is seen twice or out of order.
+ *
+ * Usage: spmc-ring-stress [-r max readers] [-c capacity] [-d seconds per run]
+ * Exits non-zero if any entry read was inconsistent.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "../aesd-char-driver/aesd-spmc-ring.h"
+
+#define PAYLOAD 4096
+
+enum stress_mode {
+    STRESS_LOCKFREE,    // random lookups in the lock-free ring
+    STRESS_MUTEX,       // random lookups in aesd_circular_buffer under a mutex
+    STRESS_FOLLOW,      // every reader follows the stream with its own cursor
+};
+
+struct reader {
+    pthread_t thread;
+    struct aesd_spmc_reader cursor;
+    unsigned int seed;
+    uint64_t reads;
+    uint64_t misses;
+    uint64_t errors;
+} AESD_CACHELINE_ALIGNED;
+
+static const char payload[PAYLOAD];
+static enum stress_mode mode;
+static struct aesd_spmc_ring ring;
+static struct aesd_circular_buffer buffer;
+static pthread_mutex_t buffer_lock = PTHREAD_MUTEX_INITIALIZER;
+static volatile int running;
+static uint64_t pushes;
+
+/**
+ * The entry the producer adds as number @param seq, so readers can check it.
+ */
+static struct aesd_buffer_entry entry_for(uint64_t seq)
+{
+    struct aesd_buffer_entry entry = {
+        .buffptr = payload + seq % PAYLOAD,
+        .size = 1 + seq % 251,
+    };
+    return entry;
+}
+
+static int entry_valid(const struct aesd_buffer_entry *entry, uint64_t seq)
+{
+    struct aesd_buffer_entry expected = entry_for(seq);
+    return entry->seq == seq && entry->buffptr == expected.buffptr && entry->size == expected.size;
+}
+
+static void *producer_func(void *arg)
+{
+    struct aesd_buffer_entry evicted;
+    uint64_t seq = 0;
+
+    (void)arg;
+    while (__atomic_load_n(&running, __ATOMIC_RELAXED)) {
+        struct aesd_buffer_entry entry = entry_for(seq);
+        if (mode == STRESS_MUTEX) {
+            pthread_mutex_lock(&buffer_lock);
+            aesd_circular_buffer_add_entry(&buffer, &entry);
+            pthread_mutex_unlock(&buffer_lock);
+        } else {
+            aesd_spmc_ring_push(&ring, &entry, &evicted);
+        }
+        seq++;
+    }
+    pushes = seq;
+    return NULL;
+}
+
+static void read_lockfree(struct reader *r)
+{
+    struct aesd_buffer_entry entry;
+    uint64_t head = aesd_spmc_ring_head(&ring);
+    uint64_t held = head < ring.capacity ? head : ring.capacity;
+
+    if (held == 0) return;
+    uint64_t seq = head - 1 - rand_r(&r->seed) % held;
+    int ret = aesd_spmc_ring_get(&ring, seq, &entry);
+    if (ret == -ENOENT) {
+        r->misses++;
+    } else if (ret == 0) {
+        r->reads++;
+        if (!entry_valid(&entry, seq)) r->errors++;
+    }
+}
+
+static void read_mutex(struct reader *r)
+{
+    struct aesd_buffer_entry entry, *found;
+    size_t offset;
+
+    pthread_mutex_lock(&buffer_lock);
+    uint64_t head = buffer.entries_added;
+    uint32_t held = aesd_circular_buffer_count(&buffer);
+    if (held == 0) {
+        pthread_mutex_unlock(&buffer_lock);
+        return;
+    }
+    uint64_t seq = head - 1 - rand_r(&r->seed) % held;
+    found = aesd_circular_buffer_find_entry_for_seq(&buffer, seq, &offset);
+    if (found) entry = *found;
+    pthread_mutex_unlock(&buffer_lock);
+
+    if (found == NULL) {
+        r->misses++;
+        return;
+    }
+    r->reads++;
+    if (!entry_valid(&entry, seq)) r->errors++;
+}
+
+static void read_follow(struct reader *r)
+{
+    struct aesd_buffer_entry entry;
+    uint64_t lost = r->cursor.lost, seq = r->cursor.cursor;
+
+    if (aesd_spmc_ring_read(&ring, &r->cursor, &entry) != 0) return;
+    r->reads++;
+    r->misses = r->cursor.lost;
+    // a skip is only allowed forward, past entries that were overwritten.
+    seq += r->cursor.lost - lost;
+    if (!entry_valid(&entry, seq) || r->cursor.cursor != seq + 1) r->errors++;
+}
+
+static void *reader_func(void *arg)
+{
+    struct reader *r = arg;
+
+    while (__atomic_load_n(&running, __ATOMIC_RELAXED)) {
+        switch (mode) {
+        case STRESS_LOCKFREE: read_lockfree(r); break;
+        case STRESS_MUTEX: read_mutex(r); break;
+        case STRESS_FOLLOW: read_follow(r); break;
+        }
+    }
+    return NULL;
+}
+
+static uint64_t run(int num_readers, double seconds, uint32_t capacity, uint64_t *errors_rtn)
+{
+    static const char *names[] = { "lockfree", "mutex", "follow" };
+    struct reader *readers = aligned_alloc(64, num_readers * sizeof(struct reader));
+    pthread_t producer;
+    uint64_t reads = 0, misses = 0, errors = 0;
+    struct timespec ts = { .tv_sec = (time_t)seconds, .tv_nsec = (seconds - (time_t)seconds) * 1e9 };
+
+    if (readers == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    memset(readers, 0, num_readers * sizeof(struct reader));
+    if (aesd_spmc_ring_init(&ring, capacity) != 0 || aesd_circular_buffer_init_capacity(&buffer, capacity) != 0) {
+        fprintf(stderr, "capacity %u: init failed\n", capacity);
+        exit(1);
+    }
+
+    running = 1;
+    pthread_create(&producer, NULL, producer_func, NULL);
+    for (int i = 0; i < num_readers; i++) {
+        readers[i].seed = i + 1;
+        pthread_create(&readers[i].thread, NULL, reader_func, &readers[i]);
+    }
+    nanosleep(&ts, NULL);
+    __atomic_store_n(&running, 0, __ATOMIC_RELAXED);
+    pthread_join(producer, NULL);
+    for (int i = 0; i < num_readers; i++) {
+        pthread_join(readers[i].thread, NULL);
+        reads += readers[i].reads;
+        misses += readers[i].misses;
+        errors += readers[i].errors;
+    }
+
+    printf("%9s %8d %14.0f %14.0f %14.0f %10llu %8llu\n", names[mode], num_readers,
+            reads / seconds, reads / seconds / num_readers, pushes / seconds,
+            (unsigned long long)misses, (unsigned long long)errors);
+
+    aesd_spmc_ring_free(&ring);
+    aesd_circular_buffer_free(&buffer);
+    free(readers);
+    *errors_rtn += errors;
+    return reads;
+}
+
+int main(int argc, char **argv)
+{
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int max_readers = cores > 1 ? cores - 1 : 1, opt;
+    uint32_t capacity = 1024;
+    double seconds = 1;
+    uint64_t errors = 0;
+
+    while ((opt = getopt(argc, argv, "r:c:d:")) != -1) {
+        switch (opt) {
+        case 'r': max_readers = atoi(optarg); break;
+        case 'c': capacity = strtoul(optarg, NULL, 10); break;
+        case 'd': seconds = atof(optarg); break;
+        default:
+            fprintf(stderr, "Usage: %s [-r max readers] [-c capacity] [-d seconds per run]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (max_readers < 1 || seconds <= 0) {
+        fprintf(stderr, "need at least one reader and a positive duration\n");
+        return 1;
+    }
+
+    printf("%ld cores, capacity %u, %.1f s per run\n", cores, capacity, seconds);
+    printf("%9s %8s %14s %14s %14s %10s %8s\n", "mode", "readers", "reads/s", "per reader/s",
+            "pushes/s", "missed", "errors");
+    for (mode = STRESS_LOCKFREE; mode <= STRESS_FOLLOW; mode++) {
+        for (int n = 1; ; n *= 2) {
+            if (n > max_readers) n = max_readers;
+            run(n, seconds, capacity, &errors);
+            if (n == max_readers) break;
+        }
+    }
+    if (errors) {
+        fprintf(stderr, "%llu inconsistent entries read\n", (unsigned long long)errors);
+        return 1;
+    }
+    return 0;
+}
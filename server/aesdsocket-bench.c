@@ -0,0 +1,355 @@
+/**
+ * @file aesdsocket-bench.c
+ * @brief Load generator and latency benchmark for aesdsocket
+ *
+ * Connection rate mode (-m connect): each client thread repeatedly connects,
+ * sends one packet, reads the response up to its own packet and disconnects,
+ * so the result is dominated by the server's per-connection setup.
+ *
+ * Stream mode (-m stream): each client thread keeps one connection open and
+ * sends -n packets of at least -s bytes, optionally paced at -r packets per second,
+ * waiting for each response before the next packet. A response is valid when
+ * it ends with the packet just sent. With -r, latency is measured from the
+ * time a packet was due rather than when it was actually sent, so a stalled
+ * server is not hidden by the client falling behind its schedule. -i switches
+ * connections to incremental mode so responses stay short as the stream grows.
+ *
+ * Results are throughput plus p50/p99/p999 latency, as text or with -j as
+ * one JSON object. Nothing here needs the char device: for regression runs,
+ * start a file backend server (make CFLAGS=-DUSE_AESD_CHAR_DEVICE=0) on
+ * loopback and point the benchmark at it. Stream mode without -i makes every
+ * response carry the whole history, which is how the zero-copy read-back is
+ * compared with the copy loop: run the same load against a server with and
+ * without -C and compare the server's CPU time in /proc/<pid>/stat.
+ *
+ * Usage: aesdsocket-bench [-H host] [-P port] [-m connect|stream] [-t threads]
+ *        [-n connections or packets per thread] [-s packet bytes] [-r packets/s] [-i] [-j]
+ */
+
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+// room for the packet header on top of the requested size.
+#define HEADER_MAX 64
+
+enum bench_mode {
+    BENCH_CONNECT,  // one packet per connection
+    BENCH_STREAM,   // many packets over one connection per thread
+};
+
+struct client {
+    pthread_t thread;
+    int id;
+    // latency of each completed packet in ns, until the end of its response.
+    double *latency;
+    int completed;
+    // set when the server closed the connection or a response did not match.
+    int failed;
+    long long bytes_sent;
+    long long bytes_received;
+};
+
+const char *host = "127.0.0.1";
+const char *port = "9000";
+enum bench_mode mode = BENCH_CONNECT;
+int num_threads = 4;
+int count = 1000;
+// packets are padded to this size, 0 sends the bare header.
+size_t packet_size = 0;
+double rate = 0;
+int incremental = 0;
+int json = 0;
+struct addrinfo *server_addr;
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void sleep_until_ns(double deadline)
+{
+    struct timespec ts = { .tv_sec = deadline / 1e9 };
+    ts.tv_nsec = deadline - ts.tv_sec * 1e9;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Fills @param pkt, of packet_size + HEADER_MAX bytes, with packet @param seq
+ * of client @param id: a header that makes it unique, padded to packet_size
+ * bytes if that is longer, and ended with a newline.
+ * @return the packet length.
+ */
+static size_t make_packet(char *pkt, int id, int seq)
+{
+    size_t len = snprintf(pkt, HEADER_MAX, "bench client %d packet %d ", id, seq);
+
+    if (packet_size <= len) {
+        pkt[len - 1] = '\n';
+        return len;
+    }
+    memset(pkt + len, 'x', packet_size - len - 1);
+    pkt[packet_size - 1] = '\n';
+    return packet_size;
+}
+
+/**
+ * Reads from @param fd until the data received ends with @param line.
+ * @param tail scratch space of at least @param len bytes.
+ * @return bytes read, or -1 if the connection failed or closed first.
+ */
+static long long read_until(int fd, const char *line, size_t len, char *tail)
+{
+    char buf[65536];
+    size_t tail_len = 0;
+    long long total = 0;
+    ssize_t nread;
+
+    while ((nread = recv(fd, buf, sizeof(buf), 0)) > 0) {
+        total += nread;
+        // keep the last len bytes received.
+        if ((size_t)nread >= len) {
+            memcpy(tail, buf + nread - len, len);
+            tail_len = len;
+        } else {
+            size_t keep = tail_len + nread > len ? len - nread : tail_len;
+            memmove(tail, tail + tail_len - keep, keep);
+            memcpy(tail + keep, buf, nread);
+            tail_len = keep + nread;
+        }
+        if (tail_len == len && memcmp(tail, line, len) == 0) return total;
+    }
+    return -1;
+}
+
+static int connect_server(void)
+{
+    int fd = socket(server_addr->ai_family, server_addr->ai_socktype, server_addr->ai_protocol);
+    if (fd == -1) return -1;
+    if (connect(fd, server_addr->ai_addr, server_addr->ai_addrlen) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int send_all(int fd, const char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t nsent = send(fd, data, len, MSG_NOSIGNAL);
+        if (nsent == -1 && errno == EINTR) continue;
+        if (nsent <= 0) return -1;
+        data += nsent;
+        len -= nsent;
+    }
+    return 0;
+}
+
+static void connect_client_func(struct client *c, char *pkt, char *tail)
+{
+    for (int i = 0; i < count; i++) {
+        size_t len = make_packet(pkt, c->id, i);
+        double start = now_ns();
+        int fd = connect_server();
+        long long nread;
+        if (fd == -1 || send_all(fd, pkt, len) == -1 ||
+                (nread = read_until(fd, pkt, len, tail)) == -1) {
+            fprintf(stderr, "client %d: connection %d failed: %s\n", c->id, i, strerror(errno));
+            if (fd != -1) close(fd);
+            c->failed = 1;
+            break;
+        }
+        close(fd);
+        c->bytes_sent += len;
+        c->bytes_received += nread;
+        c->latency[c->completed++] = now_ns() - start;
+    }
+}
+
+static void stream_client_func(struct client *c, char *pkt, char *tail)
+{
+    static const char incremental_cmd[] = "AESDCHAR_INCREMENTAL:1\n";
+    int fd = connect_server();
+    double next = now_ns();
+
+    if (fd == -1 || (incremental && send_all(fd, incremental_cmd, strlen(incremental_cmd)) == -1)) {
+        fprintf(stderr, "client %d: connect failed: %s\n", c->id, strerror(errno));
+        if (fd != -1) close(fd);
+        c->failed = 1;
+        return;
+    }
+    for (int i = 0; i < count; i++) {
+        size_t len = make_packet(pkt, c->id, i);
+        double start = now_ns();
+        long long nread;
+
+        if (rate > 0) {
+            if (start < next) sleep_until_ns(next);
+            start = next;
+            next += 1e9 / rate;
+        }
+        // the first response also carries the reply to the incremental command.
+        errno = 0;
+        if (send_all(fd, pkt, len) == -1 || (nread = read_until(fd, pkt, len, tail)) == -1) {
+            fprintf(stderr, "client %d: packet %d: no matching response: %s\n", c->id, i,
+                    errno ? strerror(errno) : "connection closed");
+            c->failed = 1;
+            break;
+        }
+        c->bytes_sent += len;
+        c->bytes_received += nread;
+        c->latency[c->completed++] = now_ns() - start;
+    }
+    close(fd);
+}
+
+static void *client_func(void *arg)
+{
+    struct client *c = arg;
+    char *pkt = malloc(packet_size + HEADER_MAX), *tail = malloc(packet_size + HEADER_MAX);
+
+    if (pkt == NULL || tail == NULL) {
+        c->failed = 1;
+    } else if (mode == BENCH_STREAM) {
+        stream_client_func(c, pkt, tail);
+    } else {
+        connect_client_func(c, pkt, tail);
+    }
+    free(tail);
+    free(pkt);
+    return NULL;
+}
+
+static double percentile(const double *sorted, int n, double q)
+{
+    size_t i = (size_t)(n * q);
+    return sorted[i < (size_t)n ? i : (size_t)n - 1];
+}
+
+static void report(const double *sorted, int total, int errors, double elapsed,
+            long long bytes_sent, long long bytes_received)
+{
+    double seconds = elapsed / 1e9;
+    double sent_mb = bytes_sent / 1e6;
+
+    if (json) {
+        printf("{\"mode\": \"%s\", \"threads\": %d, \"packet_bytes\": %zu, \"rate\": %g, "
+                "\"incremental\": %s, \"completed\": %d, \"errors\": %d, \"seconds\": %.3f, "
+                "\"ops_per_s\": %.1f, \"sent_mb_per_s\": %.3f, \"received_mb_per_s\": %.3f, "
+                "\"latency_us\": {\"p50\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f}}\n",
+                mode == BENCH_STREAM ? "stream" : "connect", num_threads, packet_size, rate,
+                incremental ? "true" : "false", total, errors, seconds, total / seconds,
+                sent_mb / seconds, bytes_received / 1e6 / seconds,
+                percentile(sorted, total, 0.5) / 1e3, percentile(sorted, total, 0.99) / 1e3,
+                percentile(sorted, total, 0.999) / 1e3, sorted[total - 1] / 1e3);
+        return;
+    }
+    if (mode == BENCH_STREAM) {
+        printf("packets %d in %.2f s: %.0f packets/s, sent %.2f MB/s, received %.2f MB/s\n",
+                total, seconds, total / seconds, sent_mb / seconds, bytes_received / 1e6 / seconds);
+    } else {
+        printf("connections %d in %.2f s: %.0f conn/s\n", total, seconds, total / seconds);
+    }
+    printf("%s us: p50 %.1f p99 %.1f p999 %.1f max %.1f\n", mode == BENCH_STREAM ? "packet" : "connection",
+            percentile(sorted, total, 0.5) / 1e3, percentile(sorted, total, 0.99) / 1e3,
+            percentile(sorted, total, 0.999) / 1e3, sorted[total - 1] / 1e3);
+    if (errors) printf("errors: %d clients stopped early\n", errors);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-H host] [-P port] [-m connect|stream] [-t threads]\n"
+            "       [-n connections or packets per thread] [-s packet bytes] [-r packets/s] [-i] [-j]\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    struct client *clients;
+    double start, elapsed, *all;
+    long long bytes_sent = 0, bytes_received = 0;
+    int opt, total = 0, errors = 0;
+
+    while ((opt = getopt(argc, argv, "H:P:m:t:n:s:r:ij")) != -1) {
+        switch (opt) {
+        case 'H': host = optarg; break;
+        case 'P': port = optarg; break;
+        case 'm':
+            if (strcmp(optarg, "connect") == 0) {
+                mode = BENCH_CONNECT;
+            } else if (strcmp(optarg, "stream") == 0) {
+                mode = BENCH_STREAM;
+            } else {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 't': num_threads = atoi(optarg); break;
+        case 'n': count = atoi(optarg); break;
+        case 's': packet_size = strtoul(optarg, NULL, 10); break;
+        case 'r': rate = atof(optarg); break;
+        case 'i': incremental = 1; break;
+        case 'j': json = 1; break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (num_threads < 1 || count < 1 || rate < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (getaddrinfo(host, port, &hints, &server_addr) != 0) {
+        fprintf(stderr, "cannot resolve %s:%s\n", host, port);
+        return 1;
+    }
+
+    clients = calloc(num_threads, sizeof(struct client));
+    all = malloc((size_t)num_threads * count * sizeof(double));
+    if (clients == NULL || all == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    start = now_ns();
+    for (int i = 0; i < num_threads; i++) {
+        clients[i].id = i;
+        clients[i].latency = all + (size_t)i * count;
+        pthread_create(&clients[i].thread, NULL, client_func, &clients[i]);
+    }
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(clients[i].thread, NULL);
+        // pack the completed samples together.
+        memmove(all + total, clients[i].latency, clients[i].completed * sizeof(double));
+        total += clients[i].completed;
+        errors += clients[i].failed;
+        bytes_sent += clients[i].bytes_sent;
+        bytes_received += clients[i].bytes_received;
+    }
+    elapsed = now_ns() - start;
+
+    if (total == 0) {
+        fprintf(stderr, "nothing completed\n");
+        return 1;
+    }
+    qsort(all, total, sizeof(double), cmp_double);
+    report(all, total, errors, elapsed, bytes_sent, bytes_received);
+
+    free(all);
+    free(clients);
+    freeaddrinfo(server_addr);
+    return errors ? 1 : 0;
+}
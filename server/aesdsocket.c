@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // splice()
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -13,13 +14,25 @@
 #include <syslog.h>
 #include <signal.h>
 #include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/signalfd.h>
+#include <poll.h>
+#include <time.h>
 #include "../aesd-char-driver/aesd_ioctl.h"
 
 #define PORT "9000"
 #define BUF_SIZE 1024
 #define NUM_CLIENTS 10
+#define MAX_EVENTS 64
+#define EPOLL_TIMEOUT_MS 500
+#define QUEUE_DEPTH 64
 
+#ifndef USE_AESD_CHAR_DEVICE
 #define USE_AESD_CHAR_DEVICE 1
+#endif
 
 #if (USE_AESD_CHAR_DEVICE)
     #define OUTFILE "/dev/aesdchar"
@@ -28,20 +41,238 @@
 #endif
 
 #define AESDCHAR_IOCSEEKTO_CMD "AESDCHAR_IOCSEEKTO:"
+#define AESDCHAR_DEVICE_CMD "AESDCHAR_DEVICE:"
+#define AESDCHAR_INCREMENTAL_CMD "AESDCHAR_INCREMENTAL:"
+#define MAX_SHARDS 64
+// packets flushed by one writev() at most.
+#define BATCH_MAX_PACKETS 256
+#define BATCH_BYTES (64 * 1024)
+#define MAX_PACKET (64 * 1024 * 1024)
+
+/**
+ * A packet waiting in a shard's group commit queue. It lives on the stack of
+ * the connection that sent it, which sleeps until the batch holding it has
+ * been written.
+ */
+struct commit {
+    STAILQ_ENTRY(commit) entries;
+    const char *pkt;
+    size_t len;
+    // shard snapshot as of the end of this packet within its batch.
+    off_t length;
+    off_t head;
+    int status;
+    int done;
+};
+
+STAILQ_HEAD(commit_list, commit);
+
+/**
+ * One output stream with its own lock: OUTFILE itself, or OUTFILE0..N-1
+ * when -n spreads clients over several device instances. Its descriptors are
+ * opened once at startup and shared by every connection.
+ */
+struct shard {
+    char path[64];
+    pthread_mutex_t lock;
+    // appends, and lseek() for the length, under lock.
+    int wfd;
+    // responses, read only with positional reads so no file position is shared.
+    // The char device's is in follow mode, where lseek() and those reads take
+    // stream offsets, and non-blocking, so a read that outruns evicted data
+    // fails rather than waiting for the next write.
+    int rfd;
+    // group commit queue, under batch_lock.
+    pthread_mutex_t batch_lock;
+    // signalled when the queue reaches batch_bytes, to cut a batch wait short.
+    pthread_cond_t filled;
+    // broadcast when a batch has been written.
+    pthread_cond_t flushed;
+    struct commit_list pending;
+    size_t pending_bytes;
+    int pending_count;
+    // set while a connection is writing a batch on behalf of the others.
+    int flushing;
+};
+
+enum shard_policy {
+    SHARD_HASH,     // a client starts on the shard its address hashes to
+    SHARD_PREFIX,   // a client starts on shard 0 until it sends AESDCHAR_DEVICE:N
+};
 
-pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+// latency histogram buckets per power of two, 16 gives about 6% resolution.
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+/**
+ * Log-linear histogram of latencies in nanoseconds, in the style of
+ * HdrHistogram: values below HIST_SUB get a bucket each, larger ones are
+ * split into HIST_SUB buckets per power of two.
+ */
+struct hist {
+    uint64_t count;
+    uint64_t max;
+    uint64_t buckets[HIST_BUCKETS];
+};
+
+/**
+ * Counters and histograms of one worker or event loop. Only the owning thread
+ * updates them, with plain relaxed loads and stores instead of atomic
+ * read-modify-writes, so the hot path never bounces a cache line between
+ * threads. A dump sums every thread's copy and may see one that is a few
+ * updates behind.
+ */
+struct stats {
+    uint64_t connections;
+    uint64_t packets;
+    // bytes received, and bytes scheduled for responses.
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    // connections dropped for sending a packet over max_packet.
+    uint64_t oversized;
+    // accept() to the first byte received on the connection.
+    struct hist first_byte;
+    // commit_packet(), group commit wait included.
+    struct hist commit;
+    // a packet being framed to the last byte of its response being sent.
+    struct hist echo;
+    // next thread in stats_head, under stats_lock.
+    struct stats *next;
+};
+
+// owner-only update that a concurrent dump may read without a data race.
+#define STAT_ADD(field, n) \
+    __atomic_store_n(&(field), __atomic_load_n(&(field), __ATOMIC_RELAXED) + (n), __ATOMIC_RELAXED)
+#define STAT_READ(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+/**
+ * Protocol state of one connection, shared by both server modes.
+ */
+struct session {
+    // index into shards of the stream this connection writes to.
+    int shard;
+    // set by AESDCHAR_INCREMENTAL:1 or -i: responses only carry data not sent before.
+    int incremental;
+    // stream offset in the shard up to which data has been sent, in incremental mode.
+    off_t delivered;
+    // statistics of the thread serving the connection.
+    struct stats *stats;
+};
+
+/**
+ * Splits a connection's byte stream into newline terminated packets. Data is
+ * received at buf + len and packets are taken from buf + start. The newline
+ * search resumes where the last one stopped, so each byte is scanned once no
+ * matter how the packet was split across reads.
+ */
+struct framer {
+    char *buf;
+    size_t cap;
+    // first byte of the packet being assembled.
+    size_t start;
+    // bytes past start already searched for a newline.
+    size_t scanned;
+    // end of the data received.
+    size_t len;
+};
+
+/**
+ * A response being streamed back: limit bytes of fd starting at off.
+ */
+struct response {
+    // descriptor the response is read from, -1 when idle.
+    int fd;
+    // set when fd was opened for this response alone and is closed after it.
+    int owned;
+    off_t off;
+    off_t limit;
+};
+
+struct shard *shards;
+// number of OUTFILE<n> shards, 0 for a single unnumbered OUTFILE.
+int num_shards = 0;
+enum shard_policy shard_policy = SHARD_HASH;
+// whether connections start in incremental mode.
+int incremental_default = 0;
+
+enum sync_policy {
+    SYNC_NONE,      // leave write-back to the kernel
+    SYNC_BATCH,     // fdatasync() the file backend after every batch
+};
+
+// a batch is cut once it holds this many bytes.
+size_t batch_bytes = BATCH_BYTES;
+// how long the first packet of a batch waits for others to join it, 0 to flush at once.
+// Not used in epoll mode, where the wait would stall every connection of the loop.
+long batch_wait_us = 0;
+enum sync_policy sync_policy = SYNC_NONE;
+// longest packet accepted, newline included. Connections sending more are dropped.
+size_t max_packet = MAX_PACKET;
+
+enum server_mode {
+    MODE_THREADS,   // one thread per connection
+    MODE_POOL,      // fixed pool of worker threads fed by a bounded queue
+    MODE_EPOLL,     // edge-triggered epoll event loops, no thread per client
+};
+
+enum server_mode mode = MODE_THREADS;
+int num_loops = 1;
+// worker pool size, 0 selects the number of online cores.
+int num_workers = 0;
+// accepted connections allowed to wait for a worker before accept() stalls.
+int queue_depth = QUEUE_DEPTH;
+// stream read-back with sendfile()/splice(), cleared by -C to force the read()/send() copy loop.
+int zero_copy = 1;
+// 0 logs connections only, -v adds every packet and command received.
+int verbose = 0;
+// Unix socket serving a stats report to each client that connects, set by -S.
+const char *stats_path = NULL;
+
+/**
+ * Per-connection state of the zero-copy read-back path.
+ */
+struct zc_state {
+    // pipe used to splice() from the char device into the socket, created on first use.
+    int pipefd[2];
+    // bytes sitting in the pipe that have not reached the socket yet.
+    size_t pending;
+    // set when the backend refused zero-copy and the copy loop must be used instead.
+    int disabled;
+};
 
 struct thread_data{
     int client_fd;
     socklen_t peer_addrlen;
     struct sockaddr_storage peer_addr;
+    // when accept() returned, CLOCK_MONOTONIC nanoseconds.
+    uint64_t accepted;
+    // statistics of the thread serving the connection.
+    struct stats *stats;
 };
 
-struct node
-{
+/**
+ * Bounded multi-producer/multi-consumer queue of accepted connections.
+ * Producers block while it is full, which pushes back on accept() and lets
+ * the kernel listen backlog absorb bursts instead of our heap.
+ */
+struct conn_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    struct thread_data *items;
+    size_t cap;
+    size_t head;
+    size_t count;
+    int closed;
+};
+
+struct worker {
     pthread_t thread;
-    // This macro does the magic to point to other nodes
-    TAILQ_ENTRY(node) nodes;
+    struct conn_queue *queue;
+    // connection being served, -1 when idle. Protected by queue->lock.
+    int client_fd;
+    struct stats *stats;
 };
 
 volatile sig_atomic_t done = 0;
@@ -65,6 +296,247 @@ void *get_in_addr(struct sockaddr *sa) {
     return &(((struct sockaddr_in6*)sa)->sin6_addr);
 }
 
+uint64_t now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+unsigned int hist_bucket(uint64_t v){
+    if (v < HIST_SUB) return v;
+    unsigned int shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB + ((v >> shift) & (HIST_SUB - 1));
+}
+
+/**
+ * @return the largest value counted in bucket @param i.
+ */
+uint64_t hist_bucket_max(unsigned int i){
+    if (i < HIST_SUB) return i;
+    unsigned int shift = i / HIST_SUB - 1;
+    // wraps to UINT64_MAX for the last bucket.
+    return ((uint64_t)(HIST_SUB + i % HIST_SUB + 1) << shift) - 1;
+}
+
+/**
+ * Adds @param v to @param h. Only the thread owning @param h may call this.
+ */
+void hist_record(struct hist *h, uint64_t v){
+    STAT_ADD(h->buckets[hist_bucket(v)], 1);
+    STAT_ADD(h->count, 1);
+    if (v > h->max) __atomic_store_n(&h->max, v, __ATOMIC_RELAXED);
+}
+
+void hist_merge(struct hist *dst, struct hist *src){
+    uint64_t max = STAT_READ(src->max);
+    for (unsigned int i = 0; i < HIST_BUCKETS; i++){
+        uint64_t n = STAT_READ(src->buckets[i]);
+        dst->buckets[i] += n;
+        // count is taken from the buckets so the two always agree.
+        dst->count += n;
+    }
+    if (max > dst->max) dst->max = max;
+}
+
+/**
+ * @return the value at quantile @param q of @param h, rounded up to its
+ * bucket's upper bound but never above the largest value seen.
+ */
+uint64_t hist_quantile(const struct hist *h, double q){
+    uint64_t rank = (uint64_t)(q * h->count + 0.5), seen = 0;
+    if (rank == 0) rank = 1;
+    for (unsigned int i = 0; i < HIST_BUCKETS; i++){
+        seen += h->buckets[i];
+        if (seen >= rank){
+            uint64_t v = hist_bucket_max(i);
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
+
+/**
+ * Adds the counters and histograms of @param src to @param dst, which no
+ * other thread may be updating.
+ */
+void stats_add(struct stats *dst, struct stats *src){
+    dst->connections += STAT_READ(src->connections);
+    dst->packets += STAT_READ(src->packets);
+    dst->bytes_in += STAT_READ(src->bytes_in);
+    dst->bytes_out += STAT_READ(src->bytes_out);
+    dst->oversized += STAT_READ(src->oversized);
+    hist_merge(&dst->first_byte, &src->first_byte);
+    hist_merge(&dst->commit, &src->commit);
+    hist_merge(&dst->echo, &src->echo);
+}
+
+// the statistics of every thread serving connections.
+struct stats *stats_head = NULL;
+pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Allocates zeroed statistics for one thread, on cache lines of their own,
+ * and adds them to those summed by stats_report().
+ * @return the statistics, or NULL if out of memory.
+ */
+struct stats *stats_register(void){
+    struct stats *st;
+    if (posix_memalign((void **)&st, 64, sizeof(struct stats)) != 0) return NULL;
+    memset(st, 0, sizeof(struct stats));
+    pthread_mutex_lock(&stats_lock);
+    st->next = stats_head;
+    stats_head = st;
+    pthread_mutex_unlock(&stats_lock);
+    return st;
+}
+
+// statistics of threads that have exited, under stats_lock.
+struct stats stats_retired;
+
+/**
+ * Folds the statistics of an exiting thread into stats_retired and frees them.
+ */
+void stats_retire(struct stats *st){
+    pthread_mutex_lock(&stats_lock);
+    struct stats **pp = &stats_head;
+    while (*pp != st) pp = &(*pp)->next;
+    *pp = st->next;
+    stats_add(&stats_retired, st);
+    pthread_mutex_unlock(&stats_lock);
+    free(st);
+}
+
+void stats_free_all(void){
+    pthread_mutex_lock(&stats_lock);
+    while (stats_head != NULL){
+        struct stats *st = stats_head;
+        stats_head = st->next;
+        free(st);
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
+
+void hist_report(FILE *out, const char *name, const struct hist *h){
+    fprintf(out, "%s_us count %llu p50 %.1f p90 %.1f p99 %.1f p999 %.1f max %.1f\n", name,
+            (unsigned long long)h->count, hist_quantile(h, 0.5) / 1e3, hist_quantile(h, 0.9) / 1e3,
+            hist_quantile(h, 0.99) / 1e3, hist_quantile(h, 0.999) / 1e3, h->max / 1e3);
+}
+
+/**
+ * Sums the statistics of every thread, live or exited, into a text report, one line for the
+ * counters and one per latency histogram.
+ * @return the report, to be freed by the caller, or NULL if out of memory.
+ */
+char *stats_report(size_t *len){
+    struct stats *sum = calloc(1, sizeof(struct stats));
+    char *report = NULL;
+    int threads = 0;
+    FILE *out;
+
+    if (sum == NULL) return NULL;
+    out = open_memstream(&report, len);
+    if (out == NULL){
+        free(sum);
+        return NULL;
+    }
+    pthread_mutex_lock(&stats_lock);
+    stats_add(sum, &stats_retired);
+    for (struct stats *st = stats_head; st != NULL; st = st->next){
+        threads++;
+        stats_add(sum, st);
+    }
+    pthread_mutex_unlock(&stats_lock);
+
+    fprintf(out, "threads %d connections %llu packets %llu bytes_in %llu bytes_out %llu oversized %llu\n",
+            threads, (unsigned long long)sum->connections, (unsigned long long)sum->packets,
+            (unsigned long long)sum->bytes_in, (unsigned long long)sum->bytes_out,
+            (unsigned long long)sum->oversized);
+    hist_report(out, "first_byte", &sum->first_byte);
+    hist_report(out, "commit", &sum->commit);
+    hist_report(out, "echo", &sum->echo);
+    free(sum);
+    if (fclose(out) != 0){
+        free(report);
+        return NULL;
+    }
+    return report;
+}
+
+/**
+ * Logs the stats report to syslog, one message per line.
+ */
+void stats_log(void){
+    size_t len;
+    char *report = stats_report(&len);
+    char *save, *line;
+
+    if (report == NULL) return;
+    for (line = strtok_r(report, "\n", &save); line != NULL; line = strtok_r(NULL, "\n", &save)){
+        syslog(LOG_INFO, "stats: %s", line);
+    }
+    free(report);
+}
+
+/**
+ * Writes the stats report to a client of the stats socket.
+ */
+void stats_send(int fd){
+    size_t len, sent = 0;
+    char *report = stats_report(&len);
+
+    if (report == NULL) return;
+    while (sent < len){
+        ssize_t n = send(fd, report + sent, len - sent, MSG_NOSIGNAL);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) break;
+        sent += n;
+    }
+    free(report);
+}
+
+/**
+ * Descriptors watched by the stats thread.
+ */
+struct stats_server {
+    pthread_t thread;
+    // readable when SIGUSR1 is pending, which every thread keeps blocked.
+    int sigfd;
+    // the -S Unix socket, or -1.
+    int listen_fd;
+};
+
+/**
+ * Dumps the statistics to syslog on SIGUSR1 and to every client of the stats
+ * socket, away from the threads serving connections.
+ */
+void *stats_thread_func(void *thread_param){
+    struct stats_server *srv = (struct stats_server *)thread_param;
+    struct pollfd pfds[2] = {
+        { .fd = srv->sigfd, .events = POLLIN },
+        { .fd = srv->listen_fd, .events = POLLIN },
+    };
+
+    while (done == 0){
+        if (poll(pfds, srv->listen_fd == -1 ? 1 : 2, EPOLL_TIMEOUT_MS) <= 0) continue;
+        if (pfds[0].revents & POLLIN){
+            struct signalfd_siginfo si;
+            if (read(srv->sigfd, &si, sizeof(si)) == sizeof(si)) stats_log();
+        }
+        if (srv->listen_fd != -1 && (pfds[1].revents & POLLIN)){
+            int cfd = accept4(srv->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+            if (cfd != -1){
+                stats_send(cfd);
+                close(cfd);
+            }
+        }
+    }
+    return thread_param;
+}
+
+// wakes the timestamp thread from its sleep once done is set.
+pthread_mutex_t ts_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t ts_wake = PTHREAD_COND_INITIALIZER;
+
 void *ts_thread_func(void* thread_param){
     while (done==0) {
         char outstr[200];
@@ -78,139 +550,830 @@ void *ts_thread_func(void* thread_param){
             break;
         }
 
-        if (strftime(outstr, sizeof(outstr), "timestamp:%a, %d %b %Y %T %z", tmp) == 0) {
+        if (strftime(outstr, sizeof(outstr) - 1, "timestamp:%a, %d %b %Y %T %z", tmp) == 0) {
             fprintf(stderr, "strftime returned 0");
             break;
         }
         printf("Result string is \"%s\"\n", outstr);
 
-        pthread_mutex_lock(&mutex);
-        FILE *fp = fopen(OUTFILE, "a");
-        if (fp != NULL){
-            // fwrite(&outstr, 1, sizeof(outstr), fp);
-            fprintf(fp, "%s\n", outstr);
-            fclose(fp);
+        size_t len = strlen(outstr);
+        outstr[len++] = '\n';
+        for (int i = 0; i < (num_shards ? num_shards : 1); i++){
+            pthread_mutex_lock(&shards[i].lock);
+            if (write(shards[i].wfd, outstr, len) != (ssize_t)len){
+                syslog(LOG_ERR, "write to %s failed: %s", shards[i].path, strerror(errno));
+            }
+            pthread_mutex_unlock(&shards[i].lock);
         }
-        pthread_mutex_unlock(&mutex);
 
-        sleep(10);
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += 10;
+        pthread_mutex_lock(&ts_lock);
+        while (done == 0 && pthread_cond_timedwait(&ts_wake, &ts_lock, &ts) != ETIMEDOUT);
+        pthread_mutex_unlock(&ts_lock);
     }
     return thread_param;
 }
 
+/**
+ * Stops the timestamp thread, which writes to the shards, so they can be destroyed.
+ */
+void stop_ts_thread(pthread_t ts_thread){
+    pthread_mutex_lock(&ts_lock);
+    pthread_cond_broadcast(&ts_wake);
+    pthread_mutex_unlock(&ts_lock);
+    pthread_join(ts_thread, NULL);
+}
+
+/**
+ * Recognises an "AESDCHAR_IOCSEEKTO:X,Y" command packet.
+ * @return 1 and fills @param seekto if @param pkt is a seek command, 0 otherwise.
+ */
+int parse_seekto(const char *pkt, size_t len, struct aesd_seekto *seekto){
+    char cmd[64] = {0};
+    if (len <= strlen(AESDCHAR_IOCSEEKTO_CMD) ||
+            strncmp(pkt, AESDCHAR_IOCSEEKTO_CMD, strlen(AESDCHAR_IOCSEEKTO_CMD)) != 0){
+        return 0;
+    }
+    memcpy(cmd, pkt, len < sizeof(cmd) - 1 ? len : sizeof(cmd) - 1);
+    return sscanf(cmd, "AESDCHAR_IOCSEEKTO:%u,%u", &seekto->write_cmd, &seekto->write_cmd_offset) == 2;
+}
+
+/**
+ * Recognises an "AESDCHAR_DEVICE:N" command packet, which moves the
+ * connection to shard N.
+ * @return 1 and fills @param shard if @param pkt is a device command, 0 otherwise.
+ */
+int parse_device(const char *pkt, size_t len, int *shard){
+    char cmd[64] = {0};
+    if (len <= strlen(AESDCHAR_DEVICE_CMD) ||
+            strncmp(pkt, AESDCHAR_DEVICE_CMD, strlen(AESDCHAR_DEVICE_CMD)) != 0){
+        return 0;
+    }
+    memcpy(cmd, pkt, len < sizeof(cmd) - 1 ? len : sizeof(cmd) - 1);
+    return sscanf(cmd, "AESDCHAR_DEVICE:%d", shard) == 1;
+}
+
+/**
+ * Recognises an "AESDCHAR_INCREMENTAL:0|1" command packet.
+ * @return 1 and fills @param on if @param pkt is an incremental command, 0 otherwise.
+ */
+int parse_incremental(const char *pkt, size_t len, int *on){
+    char cmd[64] = {0};
+    if (len <= strlen(AESDCHAR_INCREMENTAL_CMD) ||
+            strncmp(pkt, AESDCHAR_INCREMENTAL_CMD, strlen(AESDCHAR_INCREMENTAL_CMD)) != 0){
+        return 0;
+    }
+    memcpy(cmd, pkt, len < sizeof(cmd) - 1 ? len : sizeof(cmd) - 1);
+    return sscanf(cmd, "AESDCHAR_INCREMENTAL:%d", on) == 1;
+}
+
+/**
+ * Picks the shard a new client starts on.
+ * @param peer the client address as text, so a client keeps its shard across connections.
+ */
+int shard_for_peer(const char *peer){
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+
+    if (num_shards < 2 || shard_policy == SHARD_PREFIX) return 0;
+    for (; *peer; peer++){
+        hash = (hash ^ (unsigned char)*peer) * 16777619u;
+    }
+    return hash % num_shards;
+}
+
+void session_init(struct session *sess, const char *peer){
+    sess->shard = shard_for_peer(peer);
+    sess->incremental = incremental_default;
+    sess->delivered = 0;
+}
+
+/**
+ * Takes a snapshot of the shard, under its lock so it never falls in the
+ * middle of a commit.
+ * @param length returns the number of bytes it holds.
+ * @param head returns the stream offset one past its newest byte. The two only
+ * differ for the char device, which drops its oldest writes; follow mode
+ * offsets there keep counting every byte ever written.
+ */
+int shard_snapshot(struct shard *sh, off_t *length, off_t *head){
+    *length = lseek(sh->wfd, 0, SEEK_END);
+#if (USE_AESD_CHAR_DEVICE)
+    *head = lseek(sh->rfd, 0, SEEK_END);
+#else
+    *head = *length;
+#endif
+    return (*length == -1 || *head == -1) ? -1 : 0;
+}
+
+/**
+ * Writes @param n packets with writev(), picking up after short writes, and
+ * applies the sync policy once for all of them. Caller holds the shard lock.
+ * @return 0, or -1 on failure.
+ */
+int write_batch(struct shard *sh, struct iovec *iov, int n){
+    while (n > 0){
+        ssize_t nwritten = writev(sh->wfd, iov, n);
+        if (nwritten == -1 && errno == EINTR) continue;
+        if (nwritten <= 0){
+            syslog(LOG_ERR, "write to %s failed: %s", sh->path, strerror(errno));
+            return -1;
+        }
+        while (n > 0 && (size_t)nwritten >= iov->iov_len){
+            nwritten -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0){
+            iov->iov_base = (char *)iov->iov_base + nwritten;
+            iov->iov_len -= nwritten;
+        }
+    }
+#if !(USE_AESD_CHAR_DEVICE)
+    if (sync_policy == SYNC_BATCH && fdatasync(sh->wfd) == -1){
+        syslog(LOG_ERR, "fdatasync %s failed: %s", sh->path, strerror(errno));
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+/**
+ * Writes the oldest pending packets as one batch, then hands every packet in
+ * it the snapshot taken after the write, wound back by the bytes of the
+ * packets behind it so each response ends with its own packet. Waits up to
+ * batch_wait_us first for the batch to fill. Called with batch_lock held,
+ * which is dropped around the write so other connections can queue the next
+ * batch meanwhile.
+ */
+void flush_batch(struct shard *sh){
+    struct commit_list batch = STAILQ_HEAD_INITIALIZER(batch);
+    struct iovec iov[BATCH_MAX_PACKETS];
+    struct commit *c;
+    size_t bytes = 0;
+    off_t length = 0, head = 0;
+    int n = 0;
+
+    sh->flushing = 1;
+    if (batch_wait_us > 0){
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += (batch_wait_us % 1000000) * 1000;
+        ts.tv_sec += batch_wait_us / 1000000 + ts.tv_nsec / 1000000000;
+        ts.tv_nsec %= 1000000000;
+        while (sh->pending_bytes < batch_bytes && sh->pending_count < BATCH_MAX_PACKETS &&
+                pthread_cond_timedwait(&sh->filled, &sh->batch_lock, &ts) != ETIMEDOUT);
+    }
+    // queue order is commit order, so packets from one connection stay in sequence.
+    while ((c = STAILQ_FIRST(&sh->pending)) != NULL && n < BATCH_MAX_PACKETS &&
+            (n == 0 || bytes + c->len <= batch_bytes)){
+        STAILQ_REMOVE_HEAD(&sh->pending, entries);
+        STAILQ_INSERT_TAIL(&batch, c, entries);
+        iov[n].iov_base = (void *)c->pkt;
+        iov[n].iov_len = c->len;
+        bytes += c->len;
+        n++;
+    }
+    sh->pending_bytes -= bytes;
+    sh->pending_count -= n;
+    pthread_mutex_unlock(&sh->batch_lock);
+
+    pthread_mutex_lock(&sh->lock);
+    int status = write_batch(sh, iov, n);
+    if (status == 0) status = shard_snapshot(sh, &length, &head);
+    pthread_mutex_unlock(&sh->lock);
+
+    pthread_mutex_lock(&sh->batch_lock);
+    STAILQ_FOREACH(c, &batch, entries){
+        bytes -= c->len;
+        c->length = (length > (off_t)bytes) ? length - (off_t)bytes : 0;
+        c->head = head - (off_t)bytes;
+        c->status = status;
+        c->done = 1;
+    }
+    sh->flushing = 0;
+    pthread_cond_broadcast(&sh->flushed);
+}
+
+/**
+ * Appends one complete packet to the shard. Packets are assembled privately by
+ * each connection, so no shard lock is ever held across a recv() or send() on
+ * a client socket. Packets from all connections are group committed: whichever
+ * connection finds no batch in flight writes everything queued so far with a
+ * single writev(), while the rest wait for it. The snapshot bounds the
+ * read-back so it sees a consistent view that includes the packet.
+ * @return 0, or -1 on failure.
+ */
+int commit_packet(struct shard *sh, const char *pkt, size_t len, off_t *length, off_t *head){
+    struct commit c = { .pkt = pkt, .len = len, .status = -1 };
+
+    pthread_mutex_lock(&sh->batch_lock);
+    STAILQ_INSERT_TAIL(&sh->pending, &c, entries);
+    sh->pending_bytes += len;
+    sh->pending_count++;
+    if (sh->pending_bytes >= batch_bytes || sh->pending_count >= BATCH_MAX_PACKETS) pthread_cond_signal(&sh->filled);
+    while (!c.done){
+        if (sh->flushing){
+            pthread_cond_wait(&sh->flushed, &sh->batch_lock);
+        }else{
+            flush_batch(sh);
+        }
+    }
+    pthread_mutex_unlock(&sh->batch_lock);
+    *length = c.length;
+    *head = c.head;
+    return c.status;
+}
+
+/**
+ * Takes a snapshot of the shard without writing to it.
+ */
+int snapshot_length(struct shard *sh, off_t *length, off_t *head){
+    pthread_mutex_lock(&sh->lock);
+    int retval = shard_snapshot(sh, length, head);
+    pthread_mutex_unlock(&sh->lock);
+    return retval;
+}
+
+void framer_free(struct framer *f){
+    free(f->buf);
+    memset(f, 0, sizeof(*f));
+}
+
+/**
+ * Finds the next complete packet. At end of stream, trailing bytes without a
+ * newline form the last packet.
+ * @return 1 and sets @param pkt and @param len, 0 if more data is needed, or
+ * -1 with errno EMSGSIZE once the packet is known to exceed max_packet.
+ */
+int framer_next(struct framer *f, int eof, char **pkt, size_t *len){
+    char *nl = NULL;
+    size_t plen;
+
+    if (f->len > f->start + f->scanned){
+        nl = memchr(f->buf + f->start + f->scanned, '\n', f->len - f->start - f->scanned);
+    }
+
+    if (nl != NULL){
+        plen = (size_t)(nl - (f->buf + f->start)) + 1;
+    }else{
+        f->scanned = f->len - f->start;
+        if (f->scanned > max_packet){
+            errno = EMSGSIZE;
+            return -1;
+        }
+        if (!eof || f->scanned == 0) return 0;
+        plen = f->scanned;
+    }
+    if (plen > max_packet){
+        errno = EMSGSIZE;
+        return -1;
+    }
+    *pkt = f->buf + f->start;
+    *len = plen;
+    return 1;
+}
+
+/**
+ * Drops the packet returned by framer_next().
+ */
+void framer_consume(struct framer *f, size_t len){
+    f->start += len;
+    f->scanned = 0;
+    if (f->start == f->len) f->start = f->len = 0;
+}
+
+/**
+ * Makes room for the next recv(). Unconsumed data is moved to the front only
+ * when the tail runs short, and the buffer grows geometrically, but never
+ * holds more than one packet of max_packet bytes plus its newline.
+ * @return where to receive into, with @param avail set, or NULL if out of memory.
+ */
+char *framer_space(struct framer *f, size_t *avail){
+    if (f->cap - f->len < BUF_SIZE && f->start > 0){
+        memmove(f->buf, f->buf + f->start, f->len - f->start);
+        f->len -= f->start;
+        f->start = 0;
+    }
+    if (f->cap - f->len < BUF_SIZE){
+        size_t ncap = f->cap * 2 + BUF_SIZE;
+        char *nbuf = realloc(f->buf, ncap);
+        if (nbuf == NULL) return NULL;
+        f->buf = nbuf;
+        f->cap = ncap;
+    }
+    // framer_next() has checked at most max_packet bytes are pending.
+    size_t room = max_packet + 1 - (f->len - f->start);
+    *avail = f->cap - f->len;
+    if (*avail > room) *avail = room;
+    return f->buf + f->len;
+}
+
+void response_end(struct response *resp){
+    if (resp->owned) close(resp->fd);
+    resp->fd = -1;
+    resp->owned = 0;
+}
+
+/**
+ * Handles one framed packet: commits it (or applies it as a seek, device or
+ * incremental command) and describes the response to send back.
+ * @param sess the connection's protocol state, updated by commands and, in
+ * incremental mode, by the response.
+ * @param resp filled in with where the response is read from. Only seek
+ * commands get a descriptor of their own; everything else is read with
+ * positional reads from the shard's shared descriptor. Offsets are stream
+ * offsets (plain file offsets for the regular file backend), so a write
+ * evicted while the response is sent does not shift the window: the response
+ * is still the bytes between the oldest one held and @param head at the time
+ * of the snapshot, less any evicted before they are read.
+ * @return 0, or -1 on failure.
+ */
+int handle_packet(struct session *sess, const char *pkt, size_t len, struct response *resp){
+    struct aesd_seekto seekto = {0};
+    int is_seekto = parse_seekto(pkt, len, &seekto);
+    int next = sess->shard, on = 0;
+    int is_device = !is_seekto && parse_device(pkt, len, &next);
+    int is_incremental = !is_seekto && !is_device && parse_incremental(pkt, len, &on);
+    off_t length, head;
+
+    if (is_device && next != sess->shard){
+        if (next >= 0 && next < (num_shards ? num_shards : 1)){
+            sess->shard = next;
+            sess->delivered = 0;
+        }else{
+            syslog(LOG_ERR, "no device %d, staying on %s", next, shards[sess->shard].path);
+        }
+    }
+    if (is_incremental) sess->incremental = on;
+    struct shard *sh = &shards[sess->shard];
+    STAT_ADD(sess->stats->packets, 1);
+
+    int retval;
+    if (is_seekto || is_device || is_incremental){
+        retval = snapshot_length(sh, &length, &head);
+    }else{
+        uint64_t start = now_ns();
+        retval = commit_packet(sh, pkt, len, &length, &head);
+        hist_record(&sess->stats->commit, now_ns() - start);
+    }
+    if (retval == -1) return -1;
+
+    resp->fd = sh->rfd;
+    resp->owned = 0;
+    resp->off = head - length;
+    resp->limit = length;
+
+    if (is_seekto){
+        // the seek position belongs to the open file, so use a private one.
+        int rfd = open(sh->path, O_RDONLY | O_NONBLOCK);
+        if (rfd == -1){
+            syslog(LOG_ERR, "open %s failed: %s", sh->path, strerror(errno));
+            return -1;
+        }
+        resp->fd = rfd;
+        resp->owned = 1;
+#if (USE_AESD_CHAR_DEVICE)
+        // in follow mode the seek lands on a stream offset, like the shared one's.
+        uint32_t follow = 1;
+        if (ioctl(rfd, AESDCHAR_IOCFOLLOW, &follow) != 0){
+            syslog(LOG_ERR, "ioctl AESDCHAR_IOCFOLLOW failed: %s", strerror(errno));
+            response_end(resp);
+            return -1;
+        }
+#endif
+        if (verbose) syslog(LOG_USER, "token 1: %d, token 2: %d\n", seekto.write_cmd, seekto.write_cmd_offset);
+        if (ioctl(rfd, AESDCHAR_IOCSEEKTO, &seekto) != 0) {
+            syslog(LOG_ERR, "ioctl AESDCHAR_IOCSEEKTO failed: %s", strerror(errno));
+        }else{
+            off_t pos = lseek(rfd, 0, SEEK_CUR);
+            if (pos != -1){
+                resp->off = pos;
+                resp->limit = (pos < head) ? head - pos : 0;
+            }
+        }
+    }else if (sess->incremental){
+        // resume at the stream offset the last response ended on, or at the oldest
+        // byte still held; head is the one this packet's commit returned.
+        off_t base = head - length;
+        off_t start = (sess->delivered > base) ? sess->delivered : base;
+        resp->off = start;
+        resp->limit = head - start;
+        sess->delivered = head;
+    }
+    STAT_ADD(sess->stats->bytes_out, resp->limit);
+    return 0;
+}
+
+void zc_init(struct zc_state *zc){
+    zc->pipefd[0] = zc->pipefd[1] = -1;
+    zc->pending = 0;
+    zc->disabled = !zero_copy;
+}
+
+void zc_destroy(struct zc_state *zc){
+    if (zc->pipefd[0] != -1) close(zc->pipefd[0]);
+    if (zc->pipefd[1] != -1) close(zc->pipefd[1]);
+    zc->pipefd[0] = zc->pipefd[1] = -1;
+}
+
+/**
+ * Moves up to resp->limit bytes of the response to the client socket without
+ * copying them through userspace: sendfile() for the regular file backend,
+ * splice() through a pipe for the char device. Both read at resp->off and
+ * leave the shared descriptor's own position alone. Running out of char
+ * device data, after bytes were evicted under the response, ends it early.
+ * @return bytes delivered to the socket, 0 at end of file, or -1 with errno set.
+ * EAGAIN means a non-blocking socket is full; EINVAL or ENOSYS mean the
+ * backend does not support zero-copy and the caller should disable it.
+ */
+ssize_t zc_send(struct zc_state *zc, int client_fd, struct response *resp){
+#if (USE_AESD_CHAR_DEVICE)
+    if (zc->pipefd[0] == -1 && pipe2(zc->pipefd, O_NONBLOCK | O_CLOEXEC) == -1) return -1;
+    if (zc->pending == 0){
+        loff_t off = resp->off;
+        ssize_t nin = splice(resp->fd, &off, zc->pipefd[1], NULL, resp->limit, SPLICE_F_MOVE);
+        if (nin == -1 && errno == EAGAIN) return 0;
+        if (nin <= 0) return nin;
+        resp->off = off;
+        resp->limit -= nin;
+        zc->pending = nin;
+    }
+    ssize_t nout = splice(zc->pipefd[0], NULL, client_fd, NULL, zc->pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (nout > 0) zc->pending -= nout;
+    return nout;
+#else
+    (void)zc;
+    ssize_t nout = sendfile(client_fd, resp->fd, &resp->off, resp->limit);
+    if (nout > 0) resp->limit -= nout;
+    return nout;
+#endif
+}
+
+/**
+ * Reads the next chunk of the response into @param buf.
+ * @return bytes read, 0 once the response is complete, or -1 with errno set.
+ */
+ssize_t response_read(struct response *resp, char *buf, size_t size){
+    if (resp->limit <= 0) return 0;
+    if ((off_t)size > resp->limit) size = resp->limit;
+    ssize_t nread = pread(resp->fd, buf, size, resp->off);
+    // the char device skipped evicted bytes and caught up with the newest write.
+    if (nread == -1 && errno == EAGAIN) return 0;
+    if (nread > 0){
+        resp->off += nread;
+        resp->limit -= nread;
+    }
+    return nread;
+}
+
+/**
+ * Sends the response described by @param resp on a blocking socket, using
+ * zc_send() and falling back to a pread()/send() loop.
+ * @return 0, or -1 if the client has gone away (EPIPE, ECONNRESET) or the
+ * socket failed otherwise.
+ */
+int send_response(struct zc_state *zc, int client_fd, struct response *resp){
+    char buf[BUF_SIZE];
+    ssize_t nread;
+
+    while ((resp->limit > 0 || zc->pending) && !zc->disabled){
+        nread = zc_send(zc, client_fd, resp);
+        if (nread == -1 && (errno == EINVAL || errno == ENOSYS) && zc->pending == 0){
+            zc->disabled = 1;
+            break;
+        }
+        if (nread == -1 && errno == EINTR) continue;
+        if (nread == -1) return -1;
+        if (nread == 0) return 0;
+    }
+
+    while ((nread = response_read(resp, buf, sizeof(buf))) > 0) {
+        if (send(client_fd, buf, nread, MSG_NOSIGNAL) == -1)
+        {
+            if (errno != EPIPE && errno != ECONNRESET) perror("send");
+            return -1;
+        }
+    }
+    return 0;
+}
+
 void *conn_thread_func(void* thread_param) {
     ssize_t nread = 0;
-    char buf[BUF_SIZE] = {0};
     char s[INET6_ADDRSTRLEN] = {0};
     struct thread_data *tdata = (struct thread_data *)thread_param;
-    struct aesd_seekto seekto = {0};
+    // the packets being assembled, private to this connection.
+    struct framer framer = {0};
+    int eof = 0;
+    struct zc_state zc;
+    struct stats *st = tdata->stats;
+    // cleared once the first byte has been timed.
+    uint64_t accepted = tdata->accepted;
+
+    zc_init(&zc);
 
     // get peer address.
     inet_ntop(tdata->peer_addr.ss_family, get_in_addr((struct sockaddr*)&tdata->peer_addr), s, sizeof(s));
     syslog(LOG_USER, "Accepted connection from %s\n", s);
+    struct session sess;
+    session_init(&sess, s);
+    sess.stats = st;
+    STAT_ADD(st->connections, 1);
 
-    if (pthread_mutex_lock(&mutex) != 0){
-        perror("pthread_mutex_lock");
-        close(tdata->client_fd);
-        syslog(LOG_USER, "Closed connection from %s\n", s);
-        return thread_param;
-    }
+    while (1){
+        char *pkt;
+        size_t len;
+        int framed = framer_next(&framer, eof, &pkt, &len);
+        if (framed == -1){
+            syslog(LOG_ERR, "packet from %s exceeds %zu bytes, dropping connection", s, max_packet);
+            STAT_ADD(st->oversized, 1);
+            break;
+        }
+        if (framed == 0){
+            if (eof) break;
+            size_t avail;
+            char *space = framer_space(&framer, &avail);
+            if (space == NULL){
+                perror("realloc");
+                break;
+            }
+            nread = recv(tdata->client_fd, space, avail, 0);
+            if (nread == -1 && errno == EINTR) continue;
+            if (nread <= 0){
+                eof = 1;
+            }else{
+                if (accepted){
+                    hist_record(&st->first_byte, now_ns() - accepted);
+                    accepted = 0;
+                }
+                framer.len += nread;
+                STAT_ADD(st->bytes_in, nread);
+            }
+            continue;
+        }
+        if (verbose) syslog(LOG_USER, "socket received: %.*s", (int)len, pkt);
 
-    int fd1 = open(OUTFILE, O_WRONLY | O_APPEND | O_CREAT, 0666);;
-    if (fd1 == -1){
-        perror("open");
-        syslog(LOG_ERR, "open1 failed");
-        exit(-1);
-    }
-    int fd2 = open(OUTFILE, O_RDONLY);
-    if (fd2 == -1){
-        perror("fopen");
-        exit(-1);
+        struct response resp;
+        uint64_t start = now_ns();
+        if (handle_packet(&sess, pkt, len, &resp) == -1) break;
+
+        int sent = send_response(&zc, tdata->client_fd, &resp);
+        response_end(&resp);
+        // the client reset the connection or stopped reading.
+        if (sent == -1) break;
+        hist_record(&st->echo, now_ns() - start);
+        framer_consume(&framer, len);
     }
+    framer_free(&framer);
+    zc_destroy(&zc);
 
-    while((nread = recv(tdata->client_fd, &buf, BUF_SIZE, 0)) > 0) {
-        syslog(LOG_USER, "socket received: %s", buf);
-        int ret = sscanf(buf, "AESDCHAR_IOCSEEKTO:%u,%u\n", &seekto.write_cmd, &seekto.write_cmd_offset);
-        if (ret == 2){
-            syslog(LOG_USER, "token 1: %d, token 2: %d\n", seekto.write_cmd, seekto.write_cmd_offset);
-            if (ioctl(fd2, AESDCHAR_IOCSEEKTO, &seekto) != 0) {
-                syslog(LOG_ERR, "ioctl AESDCHAR_IOCSEEKTO failed: %s", strerror(errno));
+    // the caller closes the socket, once nothing can shut it down any more.
+    syslog(LOG_USER, "Closed connection from %s\n", s);
+
+    return thread_param;
+}
+
+struct ev_conn {
+    int fd;
+    char peer[INET6_ADDRSTRLEN];
+    struct session sess;
+    // bytes received but not yet framed into a complete packet.
+    struct framer rx;
+    // the response being streamed, resp.fd is -1 when idle.
+    struct response resp;
+    struct zc_state zc;
+    char txbuf[BUF_SIZE];
+    size_t txlen;
+    size_t txpos;
+    // set once the peer has shut down its write side.
+    int eof;
+    // when accept() returned, cleared once the first byte has been timed.
+    uint64_t accepted;
+    // when the packet being answered was framed.
+    uint64_t pkt_start;
+    TAILQ_ENTRY(ev_conn) conns;
+};
+
+struct ev_loop_data {
+    pthread_t thread;
+    int listen_fd;
+    // every open connection, so they can be closed on shutdown.
+    TAILQ_HEAD(conn_head_s, ev_conn) conns;
+    struct stats *stats;
+};
+
+int set_nonblocking(int fd){
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+void ev_conn_close(struct ev_conn *conn){
+    response_end(&conn->resp);
+    zc_destroy(&conn->zc);
+    close(conn->fd);
+    syslog(LOG_USER, "Closed connection from %s\n", conn->peer);
+    framer_free(&conn->rx);
+    free(conn);
+}
+
+/**
+ * Ends the response being streamed once its last byte has been sent.
+ */
+void ev_conn_response_done(struct ev_conn *conn){
+    response_end(&conn->resp);
+    hist_record(&conn->sess.stats->echo, now_ns() - conn->pkt_start);
+}
+
+/**
+ * Drives a connection as far as it can go without blocking: streams any
+ * pending response, frames newline terminated packets out of the receive
+ * buffer and drains the socket until EAGAIN, as required by EPOLLET.
+ * @return 0 if the connection is waiting on more events, -1 once it is finished.
+ */
+int ev_conn_progress(struct ev_conn *conn){
+    while (1){
+        if (conn->resp.fd != -1 && !conn->zc.disabled){
+            ssize_t nsent = (conn->resp.limit > 0 || conn->zc.pending) ? zc_send(&conn->zc, conn->fd, &conn->resp) : 0;
+            if (nsent == -1){
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+                if (errno == EINTR) continue;
+                if ((errno == EINVAL || errno == ENOSYS) && conn->zc.pending == 0){
+                    conn->zc.disabled = 1;
+                    continue;
+                }
+                return -1;
+            }
+            if (nsent == 0) ev_conn_response_done(conn);
+            continue;
+        }
+        if (conn->resp.fd != -1){
+            if (conn->txpos == conn->txlen){
+                ssize_t nread = response_read(&conn->resp, conn->txbuf, sizeof(conn->txbuf));
+                if (nread <= 0){
+                    ev_conn_response_done(conn);
+                    continue;
+                }
+                conn->txlen = nread;
+                conn->txpos = 0;
             }
-        } else {
-            if(write(fd1, &buf, nread) == -1) {
-                perror("write");
-                syslog(LOG_ERR, "write failed");
-                close(fd1);
-                return thread_param;
+            ssize_t nsent = send(conn->fd, conn->txbuf + conn->txpos, conn->txlen - conn->txpos, MSG_NOSIGNAL);
+            if (nsent == -1){
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+                if (errno == EINTR) continue;
+                return -1;
             }
+            conn->txpos += nsent;
+            continue;
         }
-        for (int i = 0; i < nread; i++){
-            if (buf[i] == '\n') {
-                syslog(LOG_USER,"got newline\n");
-                break;
+
+        char *pkt;
+        size_t len;
+        int framed = framer_next(&conn->rx, conn->eof, &pkt, &len);
+        if (framed == -1){
+            syslog(LOG_ERR, "packet from %s exceeds %zu bytes, dropping connection", conn->peer, max_packet);
+            STAT_ADD(conn->sess.stats->oversized, 1);
+            return -1;
+        }
+        if (framed == 1){
+            if (verbose) syslog(LOG_USER, "socket received: %.*s", (int)len, pkt);
+            conn->pkt_start = now_ns();
+            if (handle_packet(&conn->sess, pkt, len, &conn->resp) == -1) return -1;
+            conn->txlen = conn->txpos = 0;
+            framer_consume(&conn->rx, len);
+            continue;
+        }
+        if (conn->eof) return -1;
+
+        size_t avail;
+        char *space = framer_space(&conn->rx, &avail);
+        if (space == NULL) return -1;
+        ssize_t nread = recv(conn->fd, space, avail, 0);
+        if (nread > 0){
+            if (conn->accepted){
+                hist_record(&conn->sess.stats->first_byte, now_ns() - conn->accepted);
+                conn->accepted = 0;
             }
+            conn->rx.len += nread;
+            STAT_ADD(conn->sess.stats->bytes_in, nread);
+        }else if (nread == 0){
+            conn->eof = 1;
+        }else if (errno == EAGAIN || errno == EWOULDBLOCK){
+            return 0;
+        }else if (errno != EINTR){
+            return -1;
         }
     }
-    close(fd1);
+}
 
-    while((nread = read(fd2, buf, BUF_SIZE)) > 0) {
-        ssize_t nwrite = 0;
-        if ((nwrite = send(tdata->client_fd, buf, nread, 0)) == -1)
-        {
-            perror("send");
-            break;
+void ev_accept_all(int epfd, struct ev_loop_data *ldata){
+    while (1){
+        struct sockaddr_storage peer_addr;
+        socklen_t peer_addrlen = sizeof(peer_addr);
+        int cfd = accept(ldata->listen_fd, (struct sockaddr*)&peer_addr, &peer_addrlen);
+        uint64_t accepted = now_ns();
+        if (cfd == -1){
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR){
+                syslog(LOG_ERR, "failed to accept connection socket\n");
+            }
+            return;
+        }
+        if (set_nonblocking(cfd) == -1){
+            close(cfd);
+            continue;
         }
-    }
-    close(fd2);
 
-    if (pthread_mutex_unlock(&mutex) != 0){
-        perror("pthread_mutex_unlock");
+        struct ev_conn *conn = calloc(1, sizeof(struct ev_conn));
+        if (conn == NULL){
+            perror("calloc");
+            close(cfd);
+            continue;
+        }
+        conn->fd = cfd;
+        conn->accepted = accepted;
+        conn->resp.fd = -1;
+        zc_init(&conn->zc);
+        inet_ntop(peer_addr.ss_family, get_in_addr((struct sockaddr*)&peer_addr), conn->peer, sizeof(conn->peer));
+        syslog(LOG_USER, "Accepted connection from %s\n", conn->peer);
+        session_init(&conn->sess, conn->peer);
+        conn->sess.stats = ldata->stats;
+        STAT_ADD(ldata->stats->connections, 1);
+
+        struct epoll_event ev = {0};
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        ev.data.ptr = conn;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, cfd, &ev) == -1){
+            perror("epoll_ctl");
+            ev_conn_close(conn);
+            continue;
+        }
+        TAILQ_INSERT_TAIL(&ldata->conns, conn, conns);
     }
+}
 
-    close(tdata->client_fd);
-    syslog(LOG_USER, "Closed connection from %s\n", s);
+/**
+ * One event loop. Each loop owns its epoll instance and listening socket, so
+ * with SO_REUSEPORT the kernel spreads new connections across loops and no
+ * state is shared between them apart from the shards themselves.
+ */
+void *ev_loop_func(void *thread_param){
+    struct ev_loop_data *ldata = (struct ev_loop_data *)thread_param;
+    struct epoll_event events[MAX_EVENTS];
+    // the listening socket is tagged with a NULL pointer, connections with their ev_conn.
+    struct epoll_event ev = {0};
 
-    return thread_param;
-}
+    TAILQ_INIT(&ldata->conns);
+    int epfd = epoll_create1(0);
+    if (epfd == -1){
+        perror("epoll_create1");
+        done = 1;
+        return thread_param;
+    }
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL;
+    if (set_nonblocking(ldata->listen_fd) == -1 ||
+            epoll_ctl(epfd, EPOLL_CTL_ADD, ldata->listen_fd, &ev) == -1){
+        perror("epoll_ctl");
+        close(epfd);
+        done = 1;
+        return thread_param;
+    }
 
-int main(int argc, char *argv[]){
-    if (argc > 1){
-        // if we have some extra arguments.
-        if (strncmp(argv[1], "-d", strlen("-d")) == 0){
-            // if daemonmode was specified.
-            pid_t child_pid = fork();
-            if (child_pid == -1) { perror("fork"); exit(-1);}
-            if (child_pid != 0) {
-                // exit parent
-                exit(0);
+    while (done == 0){
+        int n = epoll_wait(epfd, events, MAX_EVENTS, EPOLL_TIMEOUT_MS);
+        for (int i = 0; i < n; i++){
+            struct ev_conn *conn = events[i].data.ptr;
+            if (conn == NULL){
+                ev_accept_all(epfd, ldata);
+                continue;
+            }
+            if ((events[i].events & EPOLLERR) || ev_conn_progress(conn) != 0){
+                TAILQ_REMOVE(&ldata->conns, conn, conns);
+                ev_conn_close(conn);
             }
-        }else{
-            fprintf(stderr,"Some invalid arguments were passed and ignored\n");
         }
     }
-    int sfd, yes = 1;
-    struct addrinfo hints, *result, *rp;
-    int rv;
-    struct node * e = NULL;
-    pthread_t ts_thread = {0};
 
-    struct sigaction sa_sigterm;
-    memset(&sa_sigterm, 0, sizeof(sa_sigterm));
-    sa_sigterm.sa_handler = sigterm_handler;
-    sigemptyset(&sa_sigterm.sa_mask);
-    if (sigaction( SIGTERM, &sa_sigterm, NULL) == -1){ //
-        // perror("sigaction");
-        exit(-1);
+    while (!TAILQ_EMPTY(&ldata->conns)){
+        struct ev_conn *conn = TAILQ_FIRST(&ldata->conns);
+        TAILQ_REMOVE(&ldata->conns, conn, conns);
+        ev_conn_close(conn);
     }
+    close(epfd);
+    return thread_param;
+}
 
-    struct sigaction sa_sigint;
-    memset(&sa_sigint, 0, sizeof(sa_sigint));
-    sa_sigint.sa_handler = sigint_handler;
-    sigemptyset(&sa_sigint.sa_mask);
-    if (sigaction( SIGINT, &sa_sigint, NULL) == -1){ // 
-        // perror("sigaction");
-        exit(-1);
-    }
+/**
+ * Creates a socket bound to PORT and listening for connections.
+ * @param reuseport set SO_REUSEPORT so several event loops can each bind their own socket.
+ * @return the listening socket, or -1 on failure.
+ */
+int open_listen_socket(int reuseport){
+    int sfd = -1, yes = 1;
+    struct addrinfo hints, *result, *rp;
+    int rv;
 
     memset(&hints, 0, sizeof(hints));
     hints.ai_family = AF_UNSPEC;
@@ -221,7 +1384,7 @@ int main(int argc, char *argv[]){
     if (rv != 0){
         fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
         syslog(LOG_ERR, "getaddrinfo: %s\n", gai_strerror(rv));
-        exit(-1);
+        return -1;
     }
 
     for (rp = result; rp != NULL; rp = rp -> ai_next){
@@ -232,11 +1395,13 @@ int main(int argc, char *argv[]){
             continue;
         }
 
-        if (setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1){
+        if (setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1 ||
+                (reuseport && setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) == -1)){
             close(sfd);
             // perror("setsockopt");
             syslog(LOG_ERR, "failed to set socket options\n");
-            exit (-1);
+            freeaddrinfo(result);
+            return -1;
         }
 
         if (bind(sfd, rp->ai_addr, rp->ai_addrlen) == -1) {
@@ -251,82 +1416,684 @@ int main(int argc, char *argv[]){
 
     if (rp == NULL){
         syslog(LOG_ERR, "failed to bind\n");
-        exit(-1);
+        return -1;
     }
 
     // Start listening for a connection.
     if (listen(sfd, NUM_CLIENTS) == -1){
         perror("listen");
         syslog(LOG_ERR, "failed to open socket\n");
-        exit(-1);
+        close(sfd);
+        return -1;
     }
+    return sfd;
+}
 
-    TAILQ_HEAD(head_s, node) head;
-    TAILQ_INIT(&head);
+/**
+ * Creates the Unix socket at @param path that serves stats reports,
+ * replacing any socket left there by an earlier run.
+ * @return the listening socket, or -1 on failure.
+ */
+int open_stats_socket(const char *path){
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)){
+        syslog(LOG_ERR, "stats socket path %s too long\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
 
-#if !(USE_AESD_CHAR_DEVICE)
-    if(pthread_create(&ts_thread, NULL, ts_thread_func, NULL) != 0){
-        perror("ts_thread create");
-        done = 1;
-        goto cleanup;
+    int sfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sfd == -1){
+        syslog(LOG_ERR, "failed to create stats socket\n");
+        return -1;
     }
-#endif
+    unlink(path);
+    if (bind(sfd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(sfd, NUM_CLIENTS) == -1){
+        perror("stats socket");
+        syslog(LOG_ERR, "failed to bind stats socket %s: %s\n", path, strerror(errno));
+        close(sfd);
+        return -1;
+    }
+    return sfd;
+}
 
-    syslog(LOG_USER, "waiting for connections...\n");
-    while(done == 0){
-        pthread_t thread = {0};
-        struct thread_data *tdata;
-        int s = 0;
-        tdata = calloc(1, sizeof(struct thread_data));
-        if (tdata == NULL){
+int conn_queue_init(struct conn_queue *q, size_t cap){
+    memset(q, 0, sizeof(*q));
+    q->items = calloc(cap, sizeof(struct thread_data));
+    if (q->items == NULL) return -1;
+    q->cap = cap;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    pthread_cond_init(&q->not_full, NULL);
+    return 0;
+}
+
+void conn_queue_destroy(struct conn_queue *q){
+    // connections that never reached a worker.
+    for (; q->count > 0; q->count--, q->head = (q->head + 1) % q->cap){
+        close(q->items[q->head].client_fd);
+    }
+    pthread_cond_destroy(&q->not_full);
+    pthread_cond_destroy(&q->not_empty);
+    pthread_mutex_destroy(&q->lock);
+    free(q->items);
+}
+
+/**
+ * Wakes every thread blocked on @param q; pops fail once the queue drains.
+ */
+void conn_queue_close(struct conn_queue *q){
+    pthread_mutex_lock(&q->lock);
+    q->closed = 1;
+    pthread_cond_broadcast(&q->not_empty);
+    pthread_cond_broadcast(&q->not_full);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/**
+ * Adds an accepted connection, waiting while the queue is full.
+ * @return 0 on success, -1 if the queue was closed or the server is exiting.
+ */
+int conn_queue_push(struct conn_queue *q, const struct thread_data *tdata){
+    pthread_mutex_lock(&q->lock);
+    while (q->count == q->cap && !q->closed && done == 0){
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += 1;
+        pthread_cond_timedwait(&q->not_full, &q->lock, &ts);
+    }
+    if (q->closed || done != 0){
+        pthread_mutex_unlock(&q->lock);
+        return -1;
+    }
+    q->items[(q->head + q->count) % q->cap] = *tdata;
+    q->count++;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+    return 0;
+}
+
+/**
+ * Takes the oldest connection for @param w and records it as w's active client.
+ * @return 0 on success, -1 once the queue is closed.
+ */
+int conn_queue_pop(struct conn_queue *q, struct worker *w, struct thread_data *tdata){
+    pthread_mutex_lock(&q->lock);
+    w->client_fd = -1;
+    while (q->count == 0 && !q->closed){
+        pthread_cond_wait(&q->not_empty, &q->lock);
+    }
+    if (q->closed){
+        pthread_mutex_unlock(&q->lock);
+        return -1;
+    }
+    *tdata = q->items[q->head];
+    q->head = (q->head + 1) % q->cap;
+    q->count--;
+    w->client_fd = tdata->client_fd;
+    pthread_cond_signal(&q->not_full);
+    pthread_mutex_unlock(&q->lock);
+    return 0;
+}
+
+void *worker_func(void *thread_param){
+    struct worker *w = (struct worker *)thread_param;
+    struct thread_data tdata;
+
+    while (conn_queue_pop(w->queue, w, &tdata) == 0){
+        tdata.stats = w->stats;
+        conn_thread_func(&tdata);
+        pthread_mutex_lock(&w->queue->lock);
+        w->client_fd = -1;
+        pthread_mutex_unlock(&w->queue->lock);
+        close(tdata.client_fd);
+    }
+    return thread_param;
+}
+
+/**
+ * Starts the stats thread, with SIGUSR1 already blocked in every thread.
+ * @return 0 on success, -1 on failure.
+ */
+int start_stats_server(struct stats_server *srv){
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    srv->listen_fd = -1;
+    srv->sigfd = signalfd(-1, &mask, SFD_CLOEXEC);
+    if (srv->sigfd == -1){
+        perror("signalfd");
+        return -1;
+    }
+    if (stats_path != NULL && (srv->listen_fd = open_stats_socket(stats_path)) == -1){
+        close(srv->sigfd);
+        return -1;
+    }
+    if (pthread_create(&srv->thread, NULL, stats_thread_func, srv) != 0){
+        perror("pthread_create");
+        if (srv->listen_fd != -1) close(srv->listen_fd);
+        close(srv->sigfd);
+        return -1;
+    }
+    return 0;
+}
+
+void stop_stats_server(struct stats_server *srv){
+    pthread_join(srv->thread, NULL);
+    if (srv->listen_fd != -1){
+        close(srv->listen_fd);
+        unlink(stats_path);
+    }
+    close(srv->sigfd);
+}
+
+/**
+ * Blocks SIGINT and SIGTERM in the calling thread so helper threads created
+ * afterwards inherit the mask and the signals interrupt main()'s accept().
+ */
+void block_exit_signals(sigset_t *oldmask){
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, oldmask);
+}
+
+/**
+ * A connection served by a thread of its own, in MODE_THREADS.
+ */
+struct conn_thread {
+    pthread_t thread;
+    struct thread_data tdata;
+    // set once the connection is over and the socket is about to be closed.
+    int finished;
+    TAILQ_ENTRY(conn_thread) entries;
+};
+
+TAILQ_HEAD(conn_thread_list, conn_thread);
+
+// protects conn_thread.finished against shutdown() of a socket being closed.
+pthread_mutex_t conn_threads_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void *conn_thread_main(void *thread_param){
+    struct conn_thread *ct = (struct conn_thread *)thread_param;
+
+    ct->tdata.stats = stats_register();
+    if (ct->tdata.stats == NULL){
+        perror("stats_register");
+    }else{
+        conn_thread_func(&ct->tdata);
+        stats_retire(ct->tdata.stats);
+    }
+    pthread_mutex_lock(&conn_threads_lock);
+    ct->finished = 1;
+    pthread_mutex_unlock(&conn_threads_lock);
+    close(ct->tdata.client_fd);
+    return thread_param;
+}
+
+/**
+ * Joins and frees the threads of connections that are over.
+ */
+void conn_threads_reap(struct conn_thread_list *threads){
+    struct conn_thread *ct = TAILQ_FIRST(threads);
+    while (ct != NULL){
+        struct conn_thread *next = TAILQ_NEXT(ct, entries);
+        pthread_mutex_lock(&conn_threads_lock);
+        int finished = ct->finished;
+        pthread_mutex_unlock(&conn_threads_lock);
+        if (finished){
+            pthread_join(ct->thread, NULL);
+            TAILQ_REMOVE(threads, ct, entries);
+            free(ct);
+        }
+        ct = next;
+    }
+}
+
+/**
+ * Serves each connection accepted on @param sfd with a thread of its own
+ * until a signal sets done. Idle clients cost a thread each but never keep
+ * other clients waiting, unlike the fixed pool.
+ */
+void run_conn_threads(int sfd){
+    struct conn_thread_list threads;
+    sigset_t oldmask;
+
+    TAILQ_INIT(&threads);
+    while (done == 0){
+        struct conn_thread *ct = calloc(1, sizeof(struct conn_thread));
+        if (ct == NULL){
             perror("calloc");
-            continue;
+            break;
         }
-        tdata->peer_addrlen = sizeof(tdata->peer_addr);
+        ct->tdata.peer_addrlen = sizeof(ct->tdata.peer_addr);
 
         // Wait for a connection.
-        tdata->client_fd = accept(sfd, (struct sockaddr*)&tdata->peer_addr, &tdata->peer_addrlen);
-        if (tdata->client_fd == -1){
-            // perror("accept");
-            syslog(LOG_ERR, "failed to accept connection socket\n");
+        ct->tdata.client_fd = accept(sfd, (struct sockaddr*)&ct->tdata.peer_addr, &ct->tdata.peer_addrlen);
+        ct->tdata.accepted = now_ns();
+        conn_threads_reap(&threads);
+        if (ct->tdata.client_fd == -1){
+            if (errno != EINTR) syslog(LOG_ERR, "failed to accept connection socket\n");
+            free(ct);
             continue;
         }
-        s = pthread_create(&thread, NULL, conn_thread_func, tdata);
+
+        block_exit_signals(&oldmask);
+        int s = pthread_create(&ct->thread, NULL, conn_thread_main, ct);
+        pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
         if (s != 0){
+            syslog(LOG_USER,"Failed to create thread\n");
+            perror("pthread_create");
+            close(ct->tdata.client_fd);
+            free(ct);
+            continue;
+        }
+        TAILQ_INSERT_TAIL(&threads, ct, entries);
+    }
+
+    // unblock threads still waiting on an idle client.
+    pthread_mutex_lock(&conn_threads_lock);
+    struct conn_thread *ct;
+    TAILQ_FOREACH(ct, &threads, entries){
+        if (!ct->finished) shutdown(ct->tdata.client_fd, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&conn_threads_lock);
+    while ((ct = TAILQ_FIRST(&threads)) != NULL){
+        pthread_join(ct->thread, NULL);
+        TAILQ_REMOVE(&threads, ct, entries);
+        free(ct);
+    }
+}
+
+/**
+ * Serves connections accepted on @param sfd with num_workers threads until a
+ * signal sets done. Connections are handed over through a queue of
+ * queue_depth entries, so no thread is created or reaped per client. A
+ * worker stays with its connection until the peer closes it, so once every
+ * worker holds an idle client later connections wait; hence -m pool is opt-in.
+ */
+void run_worker_pool(int sfd){
+    struct conn_queue queue;
+    struct worker *workers;
+    sigset_t oldmask;
+    int started;
+
+    if (num_workers == 0){
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        num_workers = ncpu > 0 ? ncpu : 1;
+    }
+    if (conn_queue_init(&queue, queue_depth) != 0){
+        perror("calloc");
+        return;
+    }
+    workers = calloc(num_workers, sizeof(struct worker));
+    if (workers == NULL){
+        perror("calloc");
+        conn_queue_destroy(&queue);
+        return;
+    }
+
+    block_exit_signals(&oldmask);
+    for (started = 0; started < num_workers; started++){
+        workers[started].queue = &queue;
+        workers[started].client_fd = -1;
+        workers[started].stats = stats_register();
+        if (workers[started].stats == NULL){
+            perror("stats_register");
+            break;
+        }
+        if (pthread_create(&workers[started].thread, NULL, worker_func, &workers[started]) != 0){
             printf("Failed to create thread\n");
             syslog(LOG_USER,"Failed to create thread\n");
             perror("pthread_create");
-            free(tdata);
+            break;
         }
+    }
+    pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+    if (started == 0) done = 1;
 
-        e = malloc(sizeof(struct node));
-        if (e == NULL)
-        {
-            printf("Failed to create list node\n");
-            syslog(LOG_USER,"Failed to create list node\n");
-            perror("malloc failed");
+    while (done == 0){
+        struct thread_data tdata = {0};
+        tdata.peer_addrlen = sizeof(tdata.peer_addr);
+
+        // Wait for a connection.
+        tdata.client_fd = accept(sfd, (struct sockaddr*)&tdata.peer_addr, &tdata.peer_addrlen);
+        tdata.accepted = now_ns();
+        if (tdata.client_fd == -1){
+            // perror("accept");
+            if (errno != EINTR) syslog(LOG_ERR, "failed to accept connection socket\n");
+            continue;
+        }
+        if (conn_queue_push(&queue, &tdata) != 0){
+            close(tdata.client_fd);
+        }
+    }
+
+    conn_queue_close(&queue);
+    // unblock workers still waiting on an idle client.
+    pthread_mutex_lock(&queue.lock);
+    for (int i = 0; i < started; i++){
+        if (workers[i].client_fd != -1) shutdown(workers[i].client_fd, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&queue.lock);
+
+    for (int i = 0; i < started; i++){
+        pthread_join(workers[i].thread, NULL);
+    }
+    free(workers);
+    conn_queue_destroy(&queue);
+}
+
+/**
+ * Runs num_loops epoll event loops until a signal sets done. Loop 0 serves
+ * the socket opened by main(), every other loop binds its own SO_REUSEPORT socket.
+ */
+void run_event_loops(int sfd){
+    struct ev_loop_data *loops = calloc(num_loops, sizeof(struct ev_loop_data));
+    int started = 0;
+    if (loops == NULL){
+        perror("calloc");
+        return;
+    }
+
+    for (started = 0; started < num_loops; started++){
+        loops[started].listen_fd = (started == 0) ? sfd : open_listen_socket(1);
+        if (loops[started].listen_fd == -1) break;
+        loops[started].stats = stats_register();
+        if (loops[started].stats == NULL){
+            perror("stats_register");
+            if (started != 0) close(loops[started].listen_fd);
+            break;
+        }
+        if (pthread_create(&loops[started].thread, NULL, ev_loop_func, &loops[started]) != 0){
+            perror("pthread_create");
+            if (started != 0) close(loops[started].listen_fd);
+            break;
+        }
+    }
+    if (started < num_loops) done = 1;
+
+    for (int i = 0; i < started; i++){
+        pthread_join(loops[i].thread, NULL);
+        if (i != 0) close(loops[i].listen_fd);
+    }
+    free(loops);
+}
+
+void usage(const char *prog){
+    fprintf(stderr, "Usage: %s [-d] [-m threads|pool|epoll] [-l loops] [-w workers] [-q depth] [-C]"
+            " [-n devices] [-p hash|prefix] [-i] [-B batch bytes] [-W batch wait us, not in epoll mode] [-s none|batch]"
+            " [-M max packet bytes] [-v] [-S stats socket]\n", prog);
+}
+
+void destroy_shards(void){
+    for (int i = 0; i < (num_shards ? num_shards : 1); i++){
+        if (shards[i].wfd != -1) close(shards[i].wfd);
+        if (shards[i].rfd != -1) close(shards[i].rfd);
+#if !(USE_AESD_CHAR_DEVICE)
+        remove(shards[i].path);
+#endif
+        pthread_mutex_destroy(&shards[i].lock);
+        pthread_mutex_destroy(&shards[i].batch_lock);
+        pthread_cond_destroy(&shards[i].filled);
+        pthread_cond_destroy(&shards[i].flushed);
+    }
+    free(shards);
+}
+
+/**
+ * Fills in the shards table, OUTFILE alone or OUTFILE0..num_shards-1, and
+ * opens their descriptors.
+ * @return 0 on success, -1 with errno set on failure.
+ */
+int init_shards(void){
+    int count = num_shards ? num_shards : 1;
+    shards = calloc(count, sizeof(struct shard));
+    if (shards == NULL) return -1;
+    for (int i = 0; i < count; i++){
+        struct shard *sh = &shards[i];
+        if (num_shards){
+            snprintf(sh->path, sizeof(sh->path), OUTFILE "%d", i);
+        }else{
+            snprintf(sh->path, sizeof(sh->path), OUTFILE);
+        }
+        pthread_mutex_init(&sh->lock, NULL);
+        pthread_mutex_init(&sh->batch_lock, NULL);
+        pthread_cond_init(&sh->filled, NULL);
+        pthread_cond_init(&sh->flushed, NULL);
+        STAILQ_INIT(&sh->pending);
+        sh->wfd = open(sh->path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+#if (USE_AESD_CHAR_DEVICE)
+        uint32_t on = 1;
+        sh->rfd = open(sh->path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        if (sh->rfd != -1 && ioctl(sh->rfd, AESDCHAR_IOCFOLLOW, &on) != 0){
+            close(sh->rfd);
+            sh->rfd = -1;
+        }
+#else
+        sh->rfd = open(sh->path, O_RDONLY | O_CLOEXEC);
+#endif
+        if (sh->wfd == -1 || sh->rfd == -1){
+            int err = errno;
+            syslog(LOG_ERR, "open %s failed: %s", sh->path, strerror(err));
+            num_shards = i + 1;
+            destroy_shards();
+            errno = err;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]){
+    int opt;
+    int daemon_mode = 0;
+    while ((opt = getopt(argc, argv, "dm:l:w:q:Cn:p:iB:W:s:M:vS:")) != -1){
+        switch (opt){
+        case 'd':
+            daemon_mode = 1;
+            break;
+        case 'm':
+            if (strcmp(optarg, "threads") == 0){
+                mode = MODE_THREADS;
+            }else if (strcmp(optarg, "pool") == 0){
+                mode = MODE_POOL;
+            }else if (strcmp(optarg, "epoll") == 0){
+                mode = MODE_EPOLL;
+            }else{
+                usage(argv[0]);
+                exit(-1);
+            }
+            break;
+        case 'l':
+            num_loops = atoi(optarg);
+            if (num_loops < 1){
+                usage(argv[0]);
+                exit(-1);
+            }
+            break;
+        case 'w':
+            num_workers = atoi(optarg);
+            if (num_workers < 1){
+                usage(argv[0]);
+                exit(-1);
+            }
+            break;
+        case 'q':
+            queue_depth = atoi(optarg);
+            if (queue_depth < 1){
+                usage(argv[0]);
+                exit(-1);
+            }
+            break;
+        case 'C':
+            zero_copy = 0;
+            break;
+        case 'n':
+            num_shards = atoi(optarg);
+            if (num_shards < 1 || num_shards > MAX_SHARDS){
+                usage(argv[0]);
+                exit(-1);
+            }
+            break;
+        case 'i':
+            incremental_default = 1;
+            break;
+        case 'p':
+            if (strcmp(optarg, "hash") == 0){
+                shard_policy = SHARD_HASH;
+            }else if (strcmp(optarg, "prefix") == 0){
+                shard_policy = SHARD_PREFIX;
+            }else{
+                usage(argv[0]);
+                exit(-1);
+            }
+            break;
+        case 'B':
+            batch_bytes = strtoul(optarg, NULL, 10);
+            if (batch_bytes < 1){
+                usage(argv[0]);
+                exit(-1);
+            }
+            break;
+        case 'W':
+            batch_wait_us = atol(optarg);
+            if (batch_wait_us < 0){
+                usage(argv[0]);
+                exit(-1);
+            }
+            break;
+        case 's':
+            if (strcmp(optarg, "none") == 0){
+                sync_policy = SYNC_NONE;
+            }else if (strcmp(optarg, "batch") == 0){
+                sync_policy = SYNC_BATCH;
+            }else{
+                usage(argv[0]);
+                exit(-1);
+            }
+            break;
+        case 'M':
+            max_packet = strtoul(optarg, NULL, 10);
+            if (max_packet < 1){
+                usage(argv[0]);
+                exit(-1);
+            }
+            break;
+        case 'v':
+            verbose++;
+            break;
+        case 'S':
+            stats_path = optarg;
+            break;
+        default:
+            fprintf(stderr,"Some invalid arguments were passed and ignored\n");
             break;
         }
-        e->thread = thread;
-        TAILQ_INSERT_TAIL(&head, e, nodes);
-        e=NULL;
     }
+    if (mode == MODE_EPOLL && batch_wait_us > 0){
+        // an event loop waiting for its batch to fill serves none of its other
+        // connections meanwhile, so with one loop nothing could join the batch.
+        fprintf(stderr, "-W is ignored in epoll mode\n");
+        syslog(LOG_WARNING, "-W is ignored in epoll mode\n");
+        batch_wait_us = 0;
+    }
+    if (daemon_mode){
+        // if daemonmode was specified.
+        pid_t child_pid = fork();
+        if (child_pid == -1) { perror("fork"); exit(-1);}
+        if (child_pid != 0) {
+            // exit parent
+            exit(0);
+        }
+    }
+    int sfd;
+    pthread_t ts_thread = {0};
 
-    while (!TAILQ_EMPTY(&head))
-    {
-        e = TAILQ_FIRST(&head);
-        pthread_join(e->thread, NULL);
-        TAILQ_REMOVE(&head, e, nodes);
-        free(e);
-        e = NULL;
+    struct sigaction sa_sigterm;
+    memset(&sa_sigterm, 0, sizeof(sa_sigterm));
+    sa_sigterm.sa_handler = sigterm_handler;
+    sigemptyset(&sa_sigterm.sa_mask);
+    if (sigaction( SIGTERM, &sa_sigterm, NULL) == -1){ //
+        // perror("sigaction");
+        exit(-1);
+    }
+
+    struct sigaction sa_sigint;
+    memset(&sa_sigint, 0, sizeof(sa_sigint));
+    sa_sigint.sa_handler = sigint_handler;
+    sigemptyset(&sa_sigint.sa_mask);
+    if (sigaction( SIGINT, &sa_sigint, NULL) == -1){ // 
+        // perror("sigaction");
+        exit(-1);
+    }
+
+    // sendfile() and splice() have no MSG_NOSIGNAL: a client resetting while
+    // its response is sent must fail them with EPIPE, not kill the server.
+    struct sigaction sa_sigpipe;
+    memset(&sa_sigpipe, 0, sizeof(sa_sigpipe));
+    sa_sigpipe.sa_handler = SIG_IGN;
+    sigemptyset(&sa_sigpipe.sa_mask);
+    if (sigaction(SIGPIPE, &sa_sigpipe, NULL) == -1){
+        exit(-1);
+    }
+
+    // SIGUSR1 is only taken through the stats thread's signalfd, so block it
+    // before any thread exists.
+    sigset_t usr1_mask;
+    sigemptyset(&usr1_mask);
+    sigaddset(&usr1_mask, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &usr1_mask, NULL);
+
+    if (init_shards() == -1){
+        perror("init_shards");
+        exit(-1);
+    }
+
+    sfd = open_listen_socket(mode == MODE_EPOLL && num_loops > 1);
+    if (sfd == -1){
+        exit(-1);
+    }
+
+    struct stats_server stats_srv;
+    sigset_t oldmask;
+    block_exit_signals(&oldmask);
+    int stats_started = start_stats_server(&stats_srv);
+    pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+    if (stats_started == -1){
+        destroy_shards();
+        close(sfd);
+        exit(-1);
+    }
+
+#if !(USE_AESD_CHAR_DEVICE)
+    block_exit_signals(&oldmask);
+    if(pthread_create(&ts_thread, NULL, ts_thread_func, NULL) != 0){
+        perror("ts_thread create");
+        done = 1;
+        goto cleanup;
+    }
+    pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+#endif
+
+    syslog(LOG_USER, "waiting for connections...\n");
+    if (mode == MODE_EPOLL){
+        run_event_loops(sfd);
+    }else if (mode == MODE_POOL){
+        run_worker_pool(sfd);
+    }else{
+        run_conn_threads(sfd);
     }
 
     // Cleanup.
-cleanup:
 #if !(USE_AESD_CHAR_DEVICE)
-    remove(OUTFILE);
+    stop_ts_thread(ts_thread);
 #endif
-    pthread_mutex_destroy(&mutex);
+cleanup:
+    stop_stats_server(&stats_srv);
+    stats_free_all();
+    destroy_shards();
     close(sfd);
 
     return 0;
@@ -0,0 +1,166 @@
+#include "unity.h"
+#include <stdlib.h>
+#include <string.h>
+#include "../../aesd-char-driver/aesd-circular-buffer.h"
+
+/**
+* Reference implementation of aesd_circular_buffer_find_entry_offset_for_fpos(): walks the
+* entries from the oldest one, subtracting sizes until char_offset falls inside an entry.
+*/
+static struct aesd_buffer_entry *linear_find(struct aesd_circular_buffer *buffer,
+            size_t char_offset, size_t *entry_offset_byte_rtn)
+{
+    uint32_t count = aesd_circular_buffer_count(buffer);
+    for (uint32_t n = 0; n < count; n++) {
+        struct aesd_buffer_entry *entry = &buffer->entry[aesd_circular_buffer_slot(buffer, n)];
+        if (char_offset < entry->size) {
+            *entry_offset_byte_rtn = char_offset;
+            return entry;
+        }
+        char_offset -= entry->size;
+    }
+    return NULL;
+}
+
+static size_t linear_total_size(struct aesd_circular_buffer *buffer)
+{
+    size_t total = 0;
+    uint32_t count = aesd_circular_buffer_count(buffer);
+    for (uint32_t n = 0; n < count; n++) {
+        total += buffer->entry[aesd_circular_buffer_slot(buffer, n)].size;
+    }
+    return total;
+}
+
+static void verify_against_linear(struct aesd_circular_buffer *buffer)
+{
+    size_t total = linear_total_size(buffer);
+    TEST_ASSERT_EQUAL_UINT64_MESSAGE(total, aesd_circular_buffer_total_size(buffer),
+            "total size should match the sum of entry sizes");
+    for (size_t fpos = 0; fpos <= total; fpos++) {
+        size_t expected_offset = 0, offset = 0;
+        struct aesd_buffer_entry *expected = linear_find(buffer, fpos, &expected_offset);
+        struct aesd_buffer_entry *found = aesd_circular_buffer_find_entry_offset_for_fpos(buffer, fpos, &offset);
+        TEST_ASSERT_EQUAL_PTR_MESSAGE(expected, found, "binary search should find the same entry as a linear walk");
+        if (found) {
+            TEST_ASSERT_EQUAL_UINT64_MESSAGE(expected_offset, offset, "offset within the entry should match");
+        }
+    }
+}
+
+static void add_sized_entry(struct aesd_circular_buffer *buffer, const char *data, size_t size)
+{
+    struct aesd_buffer_entry entry;
+    entry.buffptr = data;
+    entry.size = size;
+    aesd_circular_buffer_add_entry(buffer, &entry);
+}
+
+void test_circular_buffer_fpos_matches_linear_walk()
+{
+    static const char data[64] = "0123456789012345678901234567890123456789012345678901234567890";
+    struct aesd_circular_buffer buffer;
+    aesd_circular_buffer_init(&buffer);
+
+    verify_against_linear(&buffer);
+    // fill past capacity several times with varying sizes, so lookups cross the wrap point.
+    for (int i = 0; i < 4 * AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++) {
+        add_sized_entry(&buffer, data, 1 + (i * 7) % 13);
+        verify_against_linear(&buffer);
+    }
+}
+
+void test_circular_buffer_fpos_after_resize()
+{
+    static const char data[64] = "0123456789012345678901234567890123456789012345678901234567890";
+    struct aesd_circular_buffer buffer;
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_init_capacity(&buffer, 37));
+
+    for (int i = 0; i < 100; i++) {
+        add_sized_entry(&buffer, data, 1 + (i * 5) % 11);
+    }
+    verify_against_linear(&buffer);
+
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_resize(&buffer, 8, NULL));
+    TEST_ASSERT_EQUAL_UINT32(8, aesd_circular_buffer_count(&buffer));
+    verify_against_linear(&buffer);
+
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_resize(&buffer, 64, NULL));
+    for (int i = 0; i < 30; i++) {
+        add_sized_entry(&buffer, data, 1 + i % 3);
+    }
+    verify_against_linear(&buffer);
+    aesd_circular_buffer_free(&buffer);
+}
+
+void test_circular_buffer_get_entry()
+{
+    struct aesd_circular_buffer buffer;
+    size_t char_offset = 0;
+    aesd_circular_buffer_init(&buffer);
+
+    TEST_ASSERT_NULL(aesd_circular_buffer_get_entry(&buffer, 0, &char_offset));
+    for (int i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED + 3; i++) {
+        add_sized_entry(&buffer, "write\n", 6);
+    }
+    struct aesd_buffer_entry *entry = aesd_circular_buffer_get_entry(&buffer, 4, &char_offset);
+    TEST_ASSERT_NOT_NULL(entry);
+    TEST_ASSERT_EQUAL_UINT64(24, char_offset);
+    TEST_ASSERT_NULL(aesd_circular_buffer_get_entry(&buffer, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, NULL));
+}
+
+void test_circular_buffer_seq()
+{
+    struct aesd_circular_buffer buffer;
+    size_t char_offset = 0;
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_init_capacity(&buffer, 4));
+
+    TEST_ASSERT_NULL(aesd_circular_buffer_find_entry_for_seq(&buffer, 0, NULL));
+    for (int i = 0; i < 6; i++) {
+        add_sized_entry(&buffer, "write\n", 6);
+    }
+    // entries 0 and 1 were overwritten, 2..5 remain.
+    struct aesd_buffer_entry *entry = aesd_circular_buffer_find_entry_for_seq(&buffer, 3, &char_offset);
+    TEST_ASSERT_NOT_NULL(entry);
+    TEST_ASSERT_EQUAL_UINT64(3, entry->seq);
+    TEST_ASSERT_EQUAL_UINT64(6, char_offset);
+    entry = aesd_circular_buffer_find_entry_for_seq(&buffer, 0, &char_offset);
+    TEST_ASSERT_NOT_NULL(entry);
+    TEST_ASSERT_EQUAL_UINT64_MESSAGE(2, entry->seq, "an evicted seq should resolve to the oldest entry");
+    TEST_ASSERT_EQUAL_UINT64(0, char_offset);
+    TEST_ASSERT_NULL(aesd_circular_buffer_find_entry_for_seq(&buffer, 6, NULL));
+
+    // shrinking drops entries without renumbering the survivors.
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_resize(&buffer, 2, NULL));
+    entry = aesd_circular_buffer_find_entry_for_seq(&buffer, 3, &char_offset);
+    TEST_ASSERT_EQUAL_UINT64(4, entry->seq);
+    TEST_ASSERT_EQUAL_UINT64(30, aesd_circular_buffer_find_entry_for_seq(&buffer, 5, NULL)->offset);
+    aesd_circular_buffer_free(&buffer);
+}
+
+void test_circular_buffer_remove_oldest()
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry removed;
+    size_t char_offset = 0;
+    aesd_circular_buffer_init(&buffer);
+
+    TEST_ASSERT_FALSE(aesd_circular_buffer_remove_oldest(&buffer, &removed));
+    for (int i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++) {
+        add_sized_entry(&buffer, "write\n", 6);
+    }
+    TEST_ASSERT_TRUE(aesd_circular_buffer_remove_oldest(&buffer, &removed));
+    TEST_ASSERT_EQUAL_UINT64(0, removed.seq);
+    TEST_ASSERT_EQUAL_UINT32(AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - 1, aesd_circular_buffer_count(&buffer));
+    TEST_ASSERT_EQUAL_UINT64(6 * (AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - 1), aesd_circular_buffer_total_size(&buffer));
+    // positions are relative to the new oldest entry.
+    struct aesd_buffer_entry *entry = aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, 0, &char_offset);
+    TEST_ASSERT_EQUAL_UINT64(1, entry->seq);
+
+    // the freed slot is reused without evicting anything.
+    add_sized_entry(&buffer, "write\n", 6);
+    TEST_ASSERT_EQUAL_UINT32(AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, aesd_circular_buffer_count(&buffer));
+    TEST_ASSERT_EQUAL_UINT64(1, aesd_circular_buffer_get_entry(&buffer, 0, NULL)->seq);
+    while (aesd_circular_buffer_remove_oldest(&buffer, NULL)) continue;
+    TEST_ASSERT_EQUAL_UINT64(0, aesd_circular_buffer_total_size(&buffer));
+}